@@ -4,3 +4,4 @@ LDFLAGS = -fno-common -bundle -undefined dynamic_lookup
 CLUA=-I/usr/local/include
 LLUA=-llua
 
+CDEFS += -DHAVE_KQUEUE
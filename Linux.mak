@@ -1,7 +1,8 @@
 # Linux
 CC = gcc
 LDFLAGS = -fPIC -fno-common -shared
-LUA = lua5.1
+LUA = lua$(LUA_VERSION)
 CLUA=$(shell pkg-config --cflags ${LUA})
 LLUA=$(shell pkg-config --libs ${LUA})
 
+CDEFS += -DHAVE_EPOLL
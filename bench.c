@@ -0,0 +1,77 @@
+/*
+Benchmark and test host for the termios binding, see bench.lua and make bench, and
+test.lua and make test.
+
+It embeds Lua with the binding linked in, so that it benchmarks and tests the build
+in this directory. The ptys, clock, and closes all come from the binding itself, so
+that they go through the same code paths a program using it would.
+
+Usage: termios-bench script.lua [args...]
+*/
+
+#include <stdio.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+LUALIB_API int luaopen_termios (lua_State *L);
+
+static int traceback(lua_State* L)
+{
+    lua_getglobal(L, "debug");
+    lua_getfield(L, -1, "traceback");
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 2);
+    lua_call(L, 2, 1);
+
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    lua_State* L = luaL_newstate();
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s script.lua [args...]\n", argv[0]);
+        return 2;
+    }
+
+    luaL_openlibs(L);
+
+    /* require"termios" gets the linked in binding */
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    lua_pushcfunction(L, luaopen_termios);
+    lua_setfield(L, -2, "termios");
+    lua_pop(L, 2);
+
+    lua_createtable(L, argc, 0);
+    for (i = 1; i < argc; i++) {
+        lua_pushstring(L, argv[i]);
+        lua_rawseti(L, -2, i - 1);
+    }
+    lua_setglobal(L, "arg");
+
+    /* at index 1, as the error handler */
+    lua_pushcfunction(L, traceback);
+
+    if (luaL_loadfile(L, argv[1]) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    for (i = 2; i < argc; i++) {
+        lua_pushstring(L, argv[i]);
+    }
+
+    if (lua_pcall(L, argc - 2, 0, 1) != 0) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    lua_close(L);
+
+    return 0;
+}
@@ -0,0 +1,195 @@
+--[[
+Benchmarks of the termios binding on pseudo-terminal pairs, run by make bench.
+
+Writes one JSON object per line to stdout, each with a "bench" name, and its
+parameters and results, so that runs of different releases can be compared.
+
+Usage: termios-bench bench.lua [seconds]
+
+Seconds is roughly how long to run each measurement for, and defaults to 0.5.
+]]
+
+local termios = require"termios"
+
+local now = termios.monotonic
+local seconds = tonumber(arg and arg[1]) or 0.5
+
+local function json(t)
+    local keys = {}
+    for k in pairs(t) do
+        keys[#keys + 1] = k
+    end
+    table.sort(keys, function(a, b)
+        -- bench first, then alphabetical
+        if a == "bench" then return true end
+        if b == "bench" then return false end
+        return a < b
+    end)
+
+    local fields = {}
+    for _, k in ipairs(keys) do
+        local v = t[k]
+        if type(v) == "number" then
+            v = string.format("%.6g", v)
+        else
+            v = string.format("%q", tostring(v))
+        end
+        fields[#fields + 1] = string.format("%q:%s", k, v)
+    end
+    print("{" .. table.concat(fields, ",") .. "}")
+    io.stdout:flush()
+end
+
+local function openpty()
+    return assert(termios.openpty{ raw = true })
+end
+
+-- call fn repeatedly for about seconds, and return the rate in calls per second
+local function rate(fn)
+    local calls = 0
+    local batch = 1
+    local start = now()
+    local elapsed = 0
+    while elapsed < seconds do
+        for _ = 1, batch do
+            fn()
+        end
+        calls = calls + batch
+        batch = batch * 2
+        elapsed = now() - start
+    end
+    return calls / elapsed, calls
+end
+
+local function percentile(sorted, p)
+    local i = math.max(1, math.ceil(#sorted * p / 100))
+    return sorted[i]
+end
+
+-- Configuration calls, on an fd number, and on a port, which caches its attributes.
+local function config()
+    local master, slave, path = openpty()
+    local port = assert(termios.open(path, { profile = { raw = true } }))
+
+    local calls = {
+        cfraw = function(io) assert(termios.cfraw(io, "now")) end,
+        cfsetspeed = function(io) assert(termios.cfsetspeed(io, 115200, "now")) end,
+        setcanonical = function(io) assert(termios.setcanonical(io, false, "now")) end,
+        cfgetospeed = function(io) assert(termios.cfgetospeed(io)) end,
+        tcgetattr = function(io) assert(termios.tcgetattr(io)) end,
+    }
+
+    for _, name in ipairs{"cfraw", "cfsetspeed", "setcanonical", "cfgetospeed", "tcgetattr"} do
+        for kind, io in pairs{ fd = slave, port = port } do
+            local fn = calls[name]
+            local ops, n = rate(function() fn(io) end)
+            json{ bench = "config", call = name, io = kind, calls = n, ops_per_sec = ops }
+        end
+    end
+
+    port:close()
+    termios.close(slave)
+    termios.close(master)
+end
+
+-- Throughput from master to slave, for a range of write sizes.
+local function throughput()
+    local master, slave = openpty()
+    local rbuf = termios.buffer(65536)
+
+    for _, size in ipairs{ 1, 16, 64, 256, 1024, 4096 } do
+        local data = string.rep("x", size)
+
+        local ops, n = rate(function()
+            local sent = 0
+            while sent < size do
+                sent = sent + assert(termios.write(master, data, sent + 1, size - sent))
+            end
+            local got = 0
+            while got < size do
+                got = got + assert(termios.read(slave, rbuf, 1000))
+                rbuf:clear()
+            end
+        end)
+
+        json{ bench = "throughput", size = size, writes = n, writes_per_sec = ops,
+            bytes_per_sec = ops * size }
+    end
+
+    termios.close(slave)
+    termios.close(master)
+end
+
+-- Round trip of one byte, master to slave and back, as latency percentiles.
+local function latency()
+    local master, slave = openpty()
+    local samples = {}
+    local start = now()
+
+    while now() - start < seconds or #samples < 100 do
+        local t0 = now()
+        assert(termios.write(master, "p"))
+        assert(#assert(termios.read(slave, 1, 1000)) == 1)
+        assert(termios.write(slave, "q"))
+        assert(#assert(termios.read(master, 1, 1000)) == 1)
+        samples[#samples + 1] = (now() - t0) * 1e6
+    end
+
+    table.sort(samples)
+
+    json{ bench = "latency", samples = #samples, unit = "us",
+        p50 = percentile(samples, 50), p90 = percentile(samples, 90),
+        p99 = percentile(samples, 99), max = samples[#samples] }
+
+    termios.close(slave)
+    termios.close(master)
+end
+
+-- Waits on a poller of n ptys, with one of them made ready each time.
+local function poller()
+    local pairs_ = {}
+
+    for _, n in ipairs{ 1, 10, 100, 500, 1000 } do
+        while #pairs_ < n do
+            local master, slave = termios.openpty{ raw = true }
+            if not master then
+                break -- out of ptys or fds, measure what we have
+            end
+            pairs_[#pairs_ + 1] = { master, slave }
+        end
+
+        if #pairs_ < n and n > 1 then
+            json{ bench = "poller", fds = #pairs_, requested = n, skipped = "open failed" }
+            break
+        end
+
+        local p = assert(termios.poller())
+        for i = 1, n do
+            assert(p:add(pairs_[i][2], "r"))
+        end
+
+        local i = 0
+        local ops, waits = rate(function()
+            i = i % n + 1
+            local pair = pairs_[i]
+            assert(termios.write(pair[1], "w"))
+            local fds = assert(p:wait(1000))
+            assert(fds[1] == pair[2])
+            assert(termios.read(pair[2], 1))
+        end)
+
+        p:close()
+
+        json{ bench = "poller", fds = n, waits = waits, waits_per_sec = ops }
+    end
+
+    for _, pair in ipairs(pairs_) do
+        termios.close(pair[2])
+        termios.close(pair[1])
+    end
+end
+
+config()
+throughput()
+latency()
+poller()
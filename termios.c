@@ -29,7 +29,8 @@ THE POSSIBILITY OF SUCH DAMAGE.
 ** termios - get and set terminal attributes, line control, get and set baud rate
 
 Arguments are conventional:
-- io: either an io object from the standard io library or a file descriptor number
+- io: either an io object from the standard io library, a file descriptor number, or a
+  port from termios.open()
 - fd: a file descriptor number
 
 Return on failure is nil, followed by the error message, see strerror(), followed by
@@ -39,51 +40,384 @@ Notes and caveats:
 - Haven't tested portability, might need to test _BSD_SOURCE to see if cfsetspeed() or cfmakeraw() exist.
 - Error strings could be annotated with info about the system call and args that failed.
 - Could make better effort to document the functions, but your system's man pages really are the final reference.
-- Doesn't support access to all the bits and pieces of struct termios... wrapping that thing as
-  userdata would be quite the task.
+- Doesn't support access to all the bits and pieces of struct termios, but termios.tcgetattr()
+  returns it wrapped as userdata, with methods for the commonly used parts.
 */
 
+#if defined(__linux__)
+/* for ppoll() */
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/serial.h>
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+#endif
+
+#if defined(HAVE_EPOLL)
+#include <sys/epoll.h>
+#elif defined(HAVE_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
+/* The module is written to the Lua 5.1 api, which LuaJIT also has. These map the
+ * parts of it that changed to Lua 5.2, 5.3, and 5.4. */
+#if LUA_VERSION_NUM >= 502
+#define luaL_reg luaL_Reg
+#if !defined(lua_objlen)
+#define lua_objlen lua_rawlen
+#endif
+#if !defined(luaL_checkint)
+#define luaL_checkint(L, n) ((int) luaL_checkinteger(L, (n)))
+#define luaL_optint(L, n, d) ((int) luaL_optinteger(L, (n), (d)))
+#endif
+#endif
+
+#if defined(__linux__)
+/* in termios2.c, because <asm/termbits.h> conflicts with <termios.h> */
+int termios2_setbaud(int fd, int when, int ibaud, int obaud);
+int termios2_getbaud(int fd, int* ibaud, int* obaud);
+#elif defined(__APPLE__)
+#include <IOKit/serial/ioss.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
 
 #define REGID "wt.termios"
+#define BUFFERID "wt.termios.buffer"
+#define POLLERID "wt.termios.poller"
+#define SPEEDSID "wt.termios.speeds"
+#define FRAMESID "wt.termios.frames"
+#define PORTID "wt.termios.port"
+#define DRAINID "wt.termios.drain"
+#define ERRORSID "wt.termios.errors"
 
-static int push_error(lua_State* L)
+/* The error messages are cached by errno when first used, so failing, which for
+ * EAGAIN on a non-blocking io is common, doesn't call strerror() or create a string.
+ * The table in the registry at ERRORSID also has the mode of termios.errors(), as
+ * field codes. */
+#define ERRNOS 256
+
+/* Push the errmsg for err, msg if not NULL, or its strerror(), or with the codes
+ * mode of termios.errors(), err. */
+static void push_errmsg(lua_State* L, int err, const char* msg)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, ERRORSID);
+    lua_getfield(L, -1, "codes");
+
+    if (lua_toboolean(L, -1)) {
+        lua_pop(L, 2);
+        lua_pushinteger(L, err);
+        return;
+    }
+
+    lua_pop(L, 1);
+
+    if (msg) {
+        lua_pop(L, 1);
+        lua_pushstring(L, msg);
+        return;
+    }
+
+    lua_rawgeti(L, -1, err);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushstring(L, strerror(err));
+        if (err > 0 && err < ERRNOS) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, err);
+        }
+    }
+
+    lua_remove(L, -2);
+}
+
+/* Push nil, errmsg, err, see push_errmsg(). */
+static int push_failure(lua_State* L, int err, const char* msg)
 {
     lua_pushnil(L);
-    lua_pushstring(L, strerror(errno));
-    lua_pushinteger(L, errno);
+    push_errmsg(L, err, msg);
+    lua_pushinteger(L, err);
 
     return 3;
 }
 
+static int push_error(lua_State* L)
+{
+    return push_failure(L, errno, NULL);
+}
+
+#if defined(TERMIOS_STATS)
+/* Instrumentation, built with make STATS=1, see termios.stats(). The system calls made
+ * on fds are redefined below as macros that time them and record the result per fd.
+ * Without TERMIOS_STATS none of this is compiled, so it costs nothing. */
+enum {
+    STAT_READ,
+    STAT_WRITE,
+    STAT_WRITEV,
+    STAT_SENDFILE,
+    STAT_IOCTL,
+    STAT_FCNTL,
+    STAT_TCGETATTR,
+    STAT_TCSETATTR,
+    STAT_TCDRAIN,
+    STAT_TCFLUSH,
+    STAT_TCSENDBREAK,
+    STATS
+};
+
+static const char* stat_names[STATS] = {
+    "read", "write", "writev", "sendfile", "ioctl", "fcntl",
+    "tcgetattr", "tcsetattr", "tcdrain", "tcflush", "tcsendbreak",
+};
+
+/* bucket i counts calls that took from 2^i up to 2^(i+1) nanoseconds */
+#define STAT_BUCKETS 40
+#define STAT_ERRNOS 256
+
+struct stat_op {
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long long bytes;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long histogram[STAT_BUCKETS];
+};
+
+struct stat_fd {
+    struct stat_op ops[STATS];
+    unsigned long errnos[STAT_ERRNOS];
+};
+
+/* indexed by fd, shared by all threads, including io and helper threads */
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stat_fd** stat_fds;
+static int stat_nfds;
+
+static _Thread_local struct timespec stat_start;
+
+static void stat_begin(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &stat_start);
+}
+
+static long stat_end(int fd, int op, long ret)
+{
+    int err = errno;
+    struct timespec now;
+    unsigned long long ns;
+    struct stat_op* stat;
+    int bucket;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    ns = (now.tv_sec - stat_start.tv_sec) * 1000000000ULL + now.tv_nsec - stat_start.tv_nsec;
+
+    for (bucket = 0; bucket < STAT_BUCKETS - 1 && (ns >> (bucket + 1)) != 0; bucket++)
+        ;
+
+    if (fd < 0) {
+        goto done;
+    }
+
+    pthread_mutex_lock(&stat_lock);
+
+    if (fd >= stat_nfds) {
+        int nfds = fd < 64 ? 64 : fd * 2;
+        struct stat_fd** fds = realloc(stat_fds, nfds * sizeof(*fds));
+
+        if (fds == NULL) {
+            goto unlock;
+        }
+
+        memset(fds + stat_nfds, 0, (nfds - stat_nfds) * sizeof(*fds));
+        stat_fds = fds;
+        stat_nfds = nfds;
+    }
+
+    if (stat_fds[fd] == NULL && (stat_fds[fd] = calloc(1, sizeof(struct stat_fd))) == NULL) {
+        goto unlock;
+    }
+
+    stat = &stat_fds[fd]->ops[op];
+
+    stat->calls++;
+    stat->total_ns += ns;
+    stat->histogram[bucket]++;
+
+    if (ns > stat->max_ns) {
+        stat->max_ns = ns;
+    }
+
+    if (ret < 0) {
+        stat->errors++;
+        stat_fds[fd]->errnos[err < STAT_ERRNOS ? err : 0]++;
+    } else if (op == STAT_READ || op == STAT_WRITE || op == STAT_WRITEV || op == STAT_SENDFILE) {
+        stat->bytes += ret;
+    }
+
+unlock:
+    pthread_mutex_unlock(&stat_lock);
+
+done:
+    errno = err;
+
+    return ret;
+}
+
+/* Closing an fd forgets its stats, so a later fd with the same number doesn't inherit
+ * them. They are forgotten first, as once closed the number can be reused at once. */
+static int stat_close(int fd)
+{
+    pthread_mutex_lock(&stat_lock);
+
+    if (fd >= 0 && fd < stat_nfds && stat_fds[fd]) {
+        free(stat_fds[fd]);
+        stat_fds[fd] = NULL;
+    }
+
+    pthread_mutex_unlock(&stat_lock);
+
+    return close(fd);
+}
+
+/* The comma operator makes sure the start is taken before the call. */
+#define STAT_CALL(fd, op, call) (stat_begin(), stat_end((fd), (op), (call)))
+
+#define close(fd)             stat_close(fd)
+
+#define read(fd, ...)         STAT_CALL(fd, STAT_READ, read(fd, __VA_ARGS__))
+#define write(fd, ...)        STAT_CALL(fd, STAT_WRITE, write(fd, __VA_ARGS__))
+#define writev(fd, ...)       STAT_CALL(fd, STAT_WRITEV, writev(fd, __VA_ARGS__))
+#define sendfile(fd, ...)     STAT_CALL(fd, STAT_SENDFILE, sendfile(fd, __VA_ARGS__))
+#define ioctl(fd, ...)        STAT_CALL(fd, STAT_IOCTL, ioctl(fd, __VA_ARGS__))
+#define fcntl(fd, ...)        STAT_CALL(fd, STAT_FCNTL, fcntl(fd, __VA_ARGS__))
+#define tcgetattr(fd, ...)    STAT_CALL(fd, STAT_TCGETATTR, tcgetattr(fd, __VA_ARGS__))
+#define tcsetattr(fd, ...)    STAT_CALL(fd, STAT_TCSETATTR, tcsetattr(fd, __VA_ARGS__))
+#define tcdrain(fd)           STAT_CALL(fd, STAT_TCDRAIN, tcdrain(fd))
+#define tcflush(fd, ...)      STAT_CALL(fd, STAT_TCFLUSH, tcflush(fd, __VA_ARGS__))
+#define tcsendbreak(fd, ...)  STAT_CALL(fd, STAT_TCSENDBREAK, tcsendbreak(fd, __VA_ARGS__))
+#endif
+
+struct io_thread;
+
+/* A port opened with the shared option, see termios.open(). They are in a process-wide
+ * list, so every Lua state and thread that opens the device shares one of these. */
+struct shared_port {
+    struct shared_port* next;
+    char* path; /* the real path of the device */
+    int fd;
+    int refs; /* the ports referencing it, guarded by shared_lock */
+    int claimed; /* claimed by a port, see port:claim(), guarded by shared_lock */
+    pthread_mutex_t lock; /* recursive, guards termios, see port:lock() */
+    struct termios termios; /* cached attributes, shared by the ports */
+    int ibaud, obaud; /* cached baud rates without a speed_t, or 0 */
+};
+
+/* a port is an fd opened by termios.open() with options */
+struct port {
+    int fd; /* -1 if closed */
+    struct io_thread* io; /* NULL unless the port has an io thread */
+    struct termios termios; /* cached attributes, see cached_tcgetattr() */
+    int ibaud, obaud; /* cached baud rates without a speed_t, or 0 */
+    struct shared_port* shared; /* NULL unless the port is shared */
+    struct termios seen; /* the shared attributes, as last read by this port */
+    int locks; /* of shared->lock, held by this port */
+    int claimed; /* if this port claimed shared */
+};
+
+/* like luaL_checkudata(), but returns NULL if index isn't a regid userdata */
+static void* test_udata(lua_State* L, int index, const char* regid)
+{
+    void* p = lua_touserdata(L, index);
+
+    if (p == NULL || !lua_getmetatable(L, index)) {
+        return NULL;
+    }
+
+    luaL_getmetatable(L, regid);
+
+    if (!lua_rawequal(L, -1, -2)) {
+        p = NULL;
+    }
+
+    lua_pop(L, 2);
+
+    return p;
+}
+
 /* for a closed io object, errors with same emsg as lua's io library */
 static int check_fileno(lua_State *L, int index)
 {
+    struct port* port;
+
     if (lua_isnumber(L, index)) {
         return luaL_checkint(L, index);
+    } else if ((port = test_udata(L, index, PORTID))) {
+        if (port->fd < 0)
+            luaL_error(L, "attempt to use a closed port");
+
+        return port->fd;
     } else {
+#if LUA_VERSION_NUM >= 502
+        luaL_Stream* f = luaL_checkudata(L, index, LUA_FILEHANDLE);
+
+        if (f->closef == NULL)
+            luaL_error(L, "attempt to use a closed file");
+
+        return fileno(f->f);
+#else
         FILE** f = luaL_checkudata(L, index, LUA_FILEHANDLE);
 
         if (*f == NULL)
             luaL_error(L, "attempt to use a closed file");
 
         return fileno(*f);
+#endif
     }
 }
 
+/* the io thread of a port at index, or NULL */
+static struct io_thread* opt_io_thread(lua_State* L, int index)
+{
+    struct port* port = test_udata(L, index, PORTID);
+
+    return port ? port->io : NULL;
+}
+
 static int check_when(lua_State *L, int index)
 {
     static const char* opts[] = { "now", "drain", "flush", NULL };
@@ -92,109 +426,472 @@ static int check_when(lua_State *L, int index)
     return opti[ luaL_checkoption(L, index, "flush", opts) ];
 }
 
-#define check_tcgetattr(L, fd, termios) \
-    if (tcgetattr(fd, termios) < 0) { \
-        return push_error(L); \
+static int termios_equal(const struct termios* a, const struct termios* b)
+{
+    return a->c_iflag == b->c_iflag && a->c_oflag == b->c_oflag
+        && a->c_cflag == b->c_cflag && a->c_lflag == b->c_lflag
+        && memcmp(a->c_cc, b->c_cc, sizeof(a->c_cc)) == 0
+        && cfgetispeed(a) == cfgetispeed(b) && cfgetospeed(a) == cfgetospeed(b);
+}
+
+/* The multi-bit fields of the flags, zero terminated. */
+static const tcflag_t oflag_fields[] = {
+#if defined(NLDLY)
+    NLDLY, CRDLY, TABDLY, BSDLY, VTDLY, FFDLY,
+#endif
+    0
+};
+
+static const tcflag_t cflag_fields[] = {
+    CSIZE,
+#if defined(CBAUD)
+    CBAUD,
+#endif
+#if defined(CIBAUD)
+    CIBAUD,
+#endif
+    0
+};
+
+/* Changed bits of flags are merged one by one, but a field is taken whole from one
+ * side, as a mix of the bits of two values of it is neither. */
+static tcflag_t merge_flags(tcflag_t current, tcflag_t seen, tcflag_t want, const tcflag_t* fields)
+{
+    tcflag_t changed = seen ^ want;
+
+    for (; *fields; fields++) {
+        if (changed & *fields) {
+            changed |= *fields;
+        }
     }
 
-#define check_tcsetattr(L, fd, opt, termios) \
-    if (tcsetattr(fd, opt, termios) < 0) { \
-        return push_error(L); \
+    return (current & ~changed) | (want & changed);
+}
+
+/* Apply the changes from seen to want onto current, so that concurrent changes of
+ * different attributes of a shared port aren't lost. */
+static void termios_merge(struct termios* merged, const struct termios* current,
+        const struct termios* seen, const struct termios* want)
+{
+    static const tcflag_t none[] = { 0 };
+    int i;
+
+    *merged = *current;
+
+    merged->c_iflag = merge_flags(current->c_iflag, seen->c_iflag, want->c_iflag, none);
+    merged->c_oflag = merge_flags(current->c_oflag, seen->c_oflag, want->c_oflag, oflag_fields);
+    merged->c_cflag = merge_flags(current->c_cflag, seen->c_cflag, want->c_cflag, cflag_fields);
+    merged->c_lflag = merge_flags(current->c_lflag, seen->c_lflag, want->c_lflag, none);
+
+    for (i = 0; i < NCCS; i++) {
+        if (want->c_cc[i] != seen->c_cc[i]) {
+            merged->c_cc[i] = want->c_cc[i];
+        }
     }
 
-/*-
--- fd = termios.fileno(io)
+    if (cfgetispeed(want) != cfgetispeed(seen)) {
+        cfsetispeed(merged, cfgetispeed(want));
+    }
+    if (cfgetospeed(want) != cfgetospeed(seen)) {
+        cfsetospeed(merged, cfgetospeed(want));
+    }
+}
 
-Return the file descriptor number for the specified io object.
+static void custom_bauds(int fd, const struct termios* termios, int* ibaud, int* obaud);
 
-Returns io on success, or nil, errmsg, errno on failure.
-*/
-static int ltermios_fileno(lua_State *L)
+/* Set the attributes of a shared port, merging the changes from seen, the attributes
+ * they were made to, or if NULL, overwriting them. */
+static int shared_tcsetattr(struct port* port, int when, const struct termios* seen,
+        const struct termios* termios)
 {
-    int fd = check_fileno(L, 1);
+    struct shared_port* shared = port->shared;
+    struct termios merged = *termios;
+    int ret = 0;
 
-    lua_pushnumber(L, fd);
+    pthread_mutex_lock(&shared->lock);
 
-    return 1;
+    /* another port changed the attributes since these were read */
+    if (seen && !termios_equal(&shared->termios, seen)) {
+        termios_merge(&merged, &shared->termios, seen, termios);
+    }
+
+    if (!termios_equal(&shared->termios, &merged)) {
+        int err;
+
+        if ((ret = tcsetattr(shared->fd, when, &merged)) < 0) {
+            err = errno;
+            tcgetattr(shared->fd, &shared->termios);
+        } else {
+            err = 0;
+            shared->termios = merged;
+        }
+        custom_bauds(shared->fd, &shared->termios, &shared->ibaud, &shared->obaud);
+        errno = err;
+    }
+
+    port->seen = shared->termios;
+
+    pthread_mutex_unlock(&shared->lock);
+
+    return ret;
 }
 
-/*-
--- io = termios.setblocking(io[, blocking])
+/* For a port at index, attributes are read from the copy cached in the port, so
+ * reading them costs no tcgetattr(), and custom baud rates are cached with them, see
+ * custom_bauds(). Setting them goes through to the device, unless they are the same
+ * as the cached copy, when the tcsetattr() is skipped, and when is ignored. Use
+ * port:refresh() if the device was changed by other means. */
+static int cached_tcgetattr(lua_State* L, int index, int fd, struct termios* termios)
+{
+    struct port* port = test_udata(L, index, PORTID);
 
-Blocking is true to set blocking, and false to set non-blocking (default is false)
+    if (port && port->shared) {
+        pthread_mutex_lock(&port->shared->lock);
+        *termios = port->seen = port->shared->termios;
+        pthread_mutex_unlock(&port->shared->lock);
+        return 0;
+    }
 
-Returns io on success, or nil, errmsg, errno on failure.
-*/
-static int ltermios_setblocking(lua_State *L)
+    if (port) {
+        *termios = port->termios;
+        return 0;
+    }
+
+    return tcgetattr(fd, termios);
+}
+
+static int cached_tcsetattr(lua_State* L, int index, int fd, int when, const struct termios* termios)
 {
-    int fd = check_fileno(L, 1);
-    int block = lua_toboolean(L, 2);
-    
-    int flags = fcntl(fd, F_GETFL);
-    if (flags<0) {
-        return push_error(L);
+    struct port* port = test_udata(L, index, PORTID);
+
+    if (port == NULL) {
+        return tcsetattr(fd, when, termios);
     }
-    
-    /* to SET blocking, we CLEAR O_NONBLOCK */
-    if (block) {
-        flags &= ~O_NONBLOCK;
-    } else {
-        flags |= O_NONBLOCK;
+
+    if (port->shared) {
+        return shared_tcsetattr(port, when, &port->seen, termios);
     }
-    
-    flags = fcntl(fd, F_SETFL, flags);
-    if (flags<0) {
-        return push_error(L);
+
+    if (termios_equal(&port->termios, termios)) {
+        return 0;
     }
-    
-    lua_settop(L, 1);
 
-    return 1;
+    if (tcsetattr(fd, when, termios) < 0) {
+        int err = errno;
+        /* some of the changes may have been made */
+        tcgetattr(fd, &port->termios);
+        custom_bauds(fd, &port->termios, &port->ibaud, &port->obaud);
+        errno = err;
+        return -1;
+    }
+
+    port->termios = *termios;
+    custom_bauds(fd, &port->termios, &port->ibaud, &port->obaud);
+
+    return 0;
 }
 
-/*-
--- io = termios.setcanonical(io, canonical, when)
+static int port_refresh(struct port* port)
+{
+    struct shared_port* shared;
+    int ret;
 
-Turns canonical mode on and off for a TTY.  Canonical defaults to true.
+    if (port->shared == NULL) {
+        ret = tcgetattr(port->fd, &port->termios);
+        custom_bauds(port->fd, &port->termios, &port->ibaud, &port->obaud);
+        return ret;
+    }
 
-When is "now", "drain", or "flush". Default is "flush".
+    shared = port->shared;
 
-Returns io on success, or nil, errmsg, errno on failure.
-*/
-/* TODO should canonical default to false? */
-static int optboolean(lua_State* L, int narg, int d)
+    pthread_mutex_lock(&shared->lock);
+    ret = tcgetattr(port->fd, &shared->termios);
+    custom_bauds(port->fd, &shared->termios, &shared->ibaud, &shared->obaud);
+    port->seen = shared->termios;
+    pthread_mutex_unlock(&shared->lock);
+
+    return ret;
+}
+
+/* After a change that bypasses the cache, such as a custom baud rate. */
+static void cached_refresh(lua_State* L, int index)
 {
-    if (lua_isnil(L, narg)) {
-        return d;
+    struct port* port = test_udata(L, index, PORTID);
+
+    if (port && port->fd >= 0) {
+        port_refresh(port);
     }
-    return lua_toboolean(L, narg);
 }
-static int ltermios_setcanonical(lua_State *L)
+
+/* The lock of a shared port at index, or NULL, for changes that bypass the cache. */
+static pthread_mutex_t* shared_mutex(lua_State* L, int index)
 {
-    int fd = check_fileno(L, 1);
-    int canonical = optboolean(L, 2, 1);
-    int opt = check_when(L, 3);
-    
-    struct termios termios={0};
+    struct port* port = test_udata(L, index, PORTID);
 
-    check_tcgetattr(L, fd, &termios);
+    return port && port->shared ? &port->shared->lock : NULL;
+}
 
-    if (canonical) {
-        termios.c_lflag |= ICANON;
+static void lock_mutex(pthread_mutex_t* mutex)
+{
+    if (mutex) {
+        pthread_mutex_lock(mutex);
     }
-    else {
-        termios.c_lflag &= ~ICANON;
+}
+
+static void unlock_mutex(pthread_mutex_t* mutex)
+{
+    if (mutex) {
+        pthread_mutex_unlock(mutex);
+    }
+}
+
+#define check_tcgetattr(L, fd, termios) \
+    if (cached_tcgetattr(L, 1, fd, termios) < 0) { \
+        return push_error(L); \
     }
 
-    check_tcsetattr(L, fd, opt, &termios);
+#define check_tcsetattr(L, fd, opt, termios) \
+    if (cached_tcsetattr(L, 1, fd, opt, termios) < 0) { \
+        return push_error(L); \
+    }
 
-    lua_settop(L, 1);
+/* Timeouts are optional arguments in milliseconds, timed on the monotonic clock so
+ * they aren't affected by changes to the time of day. A nil timeout never expires. */
+static void add_ms(struct timespec* ts, double ms)
+{
+    ts->tv_sec += (time_t) (ms / 1000);
+    ts->tv_nsec += (long) ((ms - (time_t) (ms / 1000) * 1000.0) * 1000000);
+
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void set_deadline(struct timespec* deadline, double timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+
+    add_ms(deadline, timeout);
+}
+
+static int ts_before(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static lua_Number ts_seconds(const struct timespec* ts)
+{
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static int opt_deadline(lua_State* L, int index, struct timespec* deadline)
+{
+    lua_Number timeout;
+
+    if (lua_isnoneornil(L, index)) {
+        return 0;
+    }
+
+    timeout = luaL_checknumber(L, index);
+
+    luaL_argcheck(L, timeout >= 0, index, "negative timeout");
+
+    set_deadline(deadline, timeout);
 
     return 1;
 }
 
-/* Everything in my <asm-generic/termbits.h>: */
-static struct {
+/* Wait for fd to be ready for events until the deadline, a NULL deadline returns at
+ * once. Returns 1 if ready, 0 if the deadline passed, or -1 with errno set. */
+static int wait_fd(int fd, short events, const struct timespec* deadline)
+{
+    struct pollfd pfd;
+    int n;
+
+    if (deadline == NULL || fd < 0) {
+        return 1;
+    }
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    do {
+        struct timespec now;
+        struct timespec left;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        left.tv_sec = deadline->tv_sec - now.tv_sec;
+        left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+
+        if (left.tv_nsec < 0) {
+            left.tv_sec--;
+            left.tv_nsec += 1000000000L;
+        }
+        if (left.tv_sec < 0) {
+            left.tv_sec = 0;
+            left.tv_nsec = 0;
+        }
+
+#if defined(__linux__)
+        n = ppoll(&pfd, 1, &left, NULL);
+#else
+        /* round up, so as not to spin until the deadline */
+        n = poll(&pfd, 1, left.tv_sec * 1000 + (left.tv_nsec + 999999) / 1000000);
+#endif
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+}
+
+static int push_timeout(lua_State* L)
+{
+    return push_failure(L, ETIMEDOUT, "timeout");
+}
+
+/* Optional fields of an options table, -1 if the field is nil. */
+static int opt_field_boolean(lua_State* L, int index, const char* field)
+{
+    int b = -1;
+
+    lua_getfield(L, index, field);
+
+    if (!lua_isnil(L, -1)) {
+        b = lua_toboolean(L, -1);
+    }
+
+    lua_pop(L, 1);
+
+    return b;
+}
+
+static int opt_field_int(lua_State* L, int index, const char* field, int min, int max)
+{
+    int i = -1;
+
+    lua_getfield(L, index, field);
+
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isnumber(L, -1)) {
+            luaL_error(L, "field '%s' must be a number", field);
+        }
+        i = lua_tointeger(L, -1);
+        if (i < min || i > max) {
+            luaL_error(L, "field '%s' out of range", field);
+        }
+    }
+
+    lua_pop(L, 1);
+
+    return i;
+}
+
+/* waits for fd with wait_fd(), pushing the error values if it isn't ready */
+#define check_wait_fd(L, fd, events, deadline) \
+    switch (wait_fd(fd, events, deadline)) { \
+        case -1: return push_error(L); \
+        case 0: return push_timeout(L); \
+    }
+
+/*-
+-- fd = termios.fileno(io)
+
+Return the file descriptor number for the specified io object.
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_fileno(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+
+    lua_pushinteger(L, fd);
+
+    return 1;
+}
+
+/*-
+-- io = termios.setblocking(io[, blocking])
+
+Blocking is true to set blocking, and false to set non-blocking (default is false)
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_setblocking(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int block = lua_toboolean(L, 2);
+    
+    int flags = fcntl(fd, F_GETFL);
+    if (flags<0) {
+        return push_error(L);
+    }
+    
+    /* to SET blocking, we CLEAR O_NONBLOCK */
+    if (block) {
+        flags &= ~O_NONBLOCK;
+    } else {
+        flags |= O_NONBLOCK;
+    }
+    
+    flags = fcntl(fd, F_SETFL, flags);
+    if (flags<0) {
+        return push_error(L);
+    }
+    
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- io = termios.setcanonical(io, canonical, when)
+
+Turns canonical mode on and off for a TTY.  Canonical defaults to true.
+
+When is "now", "drain", or "flush". Default is "flush".
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+/* TODO should canonical default to false? */
+static int optboolean(lua_State* L, int narg, int d)
+{
+    if (lua_isnil(L, narg)) {
+        return d;
+    }
+    return lua_toboolean(L, narg);
+}
+static void setcanonical(struct termios* termios, int canonical)
+{
+    if (canonical) {
+        termios->c_lflag |= ICANON;
+    }
+    else {
+        termios->c_lflag &= ~ICANON;
+    }
+}
+static int ltermios_setcanonical(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int canonical = optboolean(L, 2, 1);
+    int opt = check_when(L, 3);
+
+    struct termios termios={0};
+
+    check_tcgetattr(L, fd, &termios);
+
+    setcanonical(&termios, canonical);
+
+    check_tcsetattr(L, fd, opt, &termios);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/* Everything in my <asm-generic/termbits.h>: */
+static struct {
     speed_t speed;
     int baud;
 } speeds[] = {
@@ -294,6 +991,130 @@ static struct {
 };
 static int SPEEDS = sizeof(speeds)/sizeof(speeds[0]);
 
+/* speeds[] is in order of baud, so it can be searched */
+static int baud2speed(int baud, speed_t* speed)
+{
+    int lo = 0;
+    int hi = SPEEDS - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (speeds[mid].baud < baud) {
+            lo = mid + 1;
+        } else if (speeds[mid].baud > baud) {
+            hi = mid - 1;
+        } else {
+            *speed = speeds[mid].speed;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* the same speeds as speeds[], as a switch the compiler can make a jump table of */
+static int speed2baud(speed_t speed, int* baud)
+{
+    switch (speed) {
+#ifdef B0
+        case B0: *baud = 0; return 0;
+#endif
+#ifdef B50
+        case B50: *baud = 50; return 0;
+#endif
+#ifdef B75
+        case B75: *baud = 75; return 0;
+#endif
+#ifdef B110
+        case B110: *baud = 110; return 0;
+#endif
+#ifdef B134
+        case B134: *baud = 134; return 0;
+#endif
+#ifdef B150
+        case B150: *baud = 150; return 0;
+#endif
+#ifdef B200
+        case B200: *baud = 200; return 0;
+#endif
+#ifdef B300
+        case B300: *baud = 300; return 0;
+#endif
+#ifdef B600
+        case B600: *baud = 600; return 0;
+#endif
+#ifdef B1200
+        case B1200: *baud = 1200; return 0;
+#endif
+#ifdef B1800
+        case B1800: *baud = 1800; return 0;
+#endif
+#ifdef B2400
+        case B2400: *baud = 2400; return 0;
+#endif
+#ifdef B4800
+        case B4800: *baud = 4800; return 0;
+#endif
+#ifdef B9600
+        case B9600: *baud = 9600; return 0;
+#endif
+#ifdef B19200
+        case B19200: *baud = 19200; return 0;
+#endif
+#ifdef B38400
+        case B38400: *baud = 38400; return 0;
+#endif
+#ifdef B57600
+        case B57600: *baud = 57600; return 0;
+#endif
+#ifdef B115200
+        case B115200: *baud = 115200; return 0;
+#endif
+#ifdef B230400
+        case B230400: *baud = 230400; return 0;
+#endif
+#ifdef B460800
+        case B460800: *baud = 460800; return 0;
+#endif
+#ifdef B500000
+        case B500000: *baud = 500000; return 0;
+#endif
+#ifdef B576000
+        case B576000: *baud = 576000; return 0;
+#endif
+#ifdef B921600
+        case B921600: *baud = 921600; return 0;
+#endif
+#ifdef B1000000
+        case B1000000: *baud = 1000000; return 0;
+#endif
+#ifdef B1152000
+        case B1152000: *baud = 1152000; return 0;
+#endif
+#ifdef B1500000
+        case B1500000: *baud = 1500000; return 0;
+#endif
+#ifdef B2000000
+        case B2000000: *baud = 2000000; return 0;
+#endif
+#ifdef B2500000
+        case B2500000: *baud = 2500000; return 0;
+#endif
+#ifdef B3000000
+        case B3000000: *baud = 3000000; return 0;
+#endif
+#ifdef B3500000
+        case B3500000: *baud = 3500000; return 0;
+#endif
+#ifdef B4000000
+        case B4000000: *baud = 4000000; return 0;
+#endif
+    }
+
+    return -1;
+}
+
 /*-
 -- speeds = { 0, 50, ..., [0] = true, [50] = true, ... }
 
@@ -304,21 +1125,32 @@ static void ltermios_newspeeds(lua_State* L)
 {
     int i;
 
-    lua_newtable(L);
+    /* the table is the same for every load of the module, so only build it once per state */
+    lua_getfield(L, LUA_REGISTRYINDEX, SPEEDSID);
+
+    if (!lua_isnil(L, -1)) {
+        return;
+    }
+
+    lua_pop(L, 1);
+
+    lua_createtable(L, SPEEDS, SPEEDS);
 
     for (i = 0; i < SPEEDS; i++) {
         int speed = speeds[i].baud;
 
         /* speeds[i+1] = speed */
-        lua_pushinteger(L, i+1);
         lua_pushinteger(L, speed);
-        lua_settable(L, -3);
+        lua_rawseti(L, -2, i+1);
 
         /* speeds[speed] = true */
         lua_pushinteger(L, speed);
         lua_pushboolean(L, 1);
-        lua_settable(L, -3);
+        lua_rawset(L, -3);
     }
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, SPEEDSID);
 }
 
 /*-
@@ -329,7 +1161,9 @@ static void ltermios_newspeeds(lua_State* L)
 Set speed for input and output, input only, or output only.
 
 Speed is the baud rate, and must be one of those supported by termios, 0, 1200,
-1400, 4800, 9600, 38400 are common.
+1400, 4800, 9600, 38400 are common. On Linux and OS X, other baud rates are set
+with termios2 or IOSSIOSPEED, if the driver supports them, though OS X can only
+set them for both input and output.
 
 For output, a speed of zero disconnects the line.
 
@@ -342,130 +1176,5209 @@ Returns io on success, or nil, errmsg, errno on failure.
 
 typedef int cfsetspeedfn(struct termios *termios_p, speed_t speed);
 
-static int setspeed(lua_State* L, cfsetspeedfn* speedfn)
+#define SPEED_IN  1
+#define SPEED_OUT 2
+
+/* Set a baud rate that has no speed_t, a negative baud leaves that direction as is.
+ * Returns 0 on success, or -1 with errno set. */
+static int setcustombaud(int fd, int when, int ibaud, int obaud)
 {
-    int fd = check_fileno(L, 1);
-    int baud = luaL_checkint(L, 2);
-    int opt = check_when(L, 3);
-    speed_t speed = 0;
-    struct termios termios;
-    int i;
+#if defined(__linux__)
+    return termios2_setbaud(fd, when, ibaud, obaud);
+#elif defined(__APPLE__)
+    /* IOSSIOSPEED always sets both directions, and takes effect immediately */
+    speed_t speed = obaud;
 
-    for (i = 0; i < SPEEDS; i++) {
-        if (speeds[i].baud == baud) {
-            speed = speeds[i].speed;
-            break;
-        }
+    if (ibaud != obaud) {
+        errno = ENOTSUP;
+        return -1;
     }
-
-    if (i == SPEEDS) {
-        lua_pushnil(L);
-        lua_pushstring(L, "unsupported speed");
-        lua_pushnumber(L, EINVAL);
-        return 3;
+    if (when == TCSADRAIN && tcdrain(fd) < 0) {
+        return -1;
+    }
+    if (ioctl(fd, IOSSIOSPEED, &speed) < 0) {
+        return -1;
     }
+    if (when == TCSAFLUSH) {
+        return tcflush(fd, TCIFLUSH);
+    }
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
 
-    check_tcgetattr(L, fd, &termios);
+/* Get a baud rate that has no speed_t, returns 0 on success, or -1 with errno set. */
+static int getcustombaud(int fd, const struct termios* termios, int dir, int* baud)
+{
+#if defined(__linux__)
+    int ibaud = 0;
+    int obaud = 0;
 
-    if (speedfn(&termios, speed) < 0) {
-        return push_error(L);
+    if (termios2_getbaud(fd, &ibaud, &obaud) < 0) {
+        return -1;
     }
 
-    check_tcsetattr(L, fd, opt, &termios);
+    *baud = dir == SPEED_IN ? ibaud : obaud;
 
-    lua_settop(L, 1);
+    return 0;
+#elif defined(__APPLE__)
+    /* speed_t is the baud rate */
+    *baud = dir == SPEED_IN ? cfgetispeed(termios) : cfgetospeed(termios);
 
-    return 1;
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
 }
 
-static int ltermios_cfsetspeed(lua_State* L)
+/* Get the baud rates of termios that have no speed_t, as 0 for those that have one,
+ * so that a cached port can return them without a system call. Errno is kept. */
+static void custom_bauds(int fd, const struct termios* termios, int* ibaud, int* obaud)
 {
-    return setspeed(L, cfsetspeed);
-}
-static int ltermios_cfsetispeed(lua_State* L)
-{
-    return setspeed(L, cfsetispeed);
-}
-static int ltermios_cfsetospeed(lua_State* L)
-{
-    return setspeed(L, cfsetospeed);
-}
+    int err = errno;
+    int baud;
 
-/*-
--- speed = termios.cfgetispeed(io)
--- speed = termios.cfgetospeed(io)
+    *ibaud = *obaud = 0;
 
-Get speed for input or output.
+    if (speed2baud(cfgetispeed(termios), &baud) < 0) {
+        getcustombaud(fd, termios, SPEED_IN, ibaud);
+    }
+    if (speed2baud(cfgetospeed(termios), &baud) < 0) {
+        getcustombaud(fd, termios, SPEED_OUT, obaud);
+    }
 
-Speed is the baud rate.
+    errno = err;
+}
 
-Returns speed on success, or nil, errmsg, errno on failure.
+/* As getcustombaud(), but from the cache of a port at index. */
+static int cached_getcustombaud(lua_State* L, int index, int fd,
+        const struct termios* termios, int dir, int* baud)
+{
+    struct port* port = test_udata(L, index, PORTID);
+
+    if (port && port->shared) {
+        pthread_mutex_lock(&port->shared->lock);
+        *baud = dir == SPEED_IN ? port->shared->ibaud : port->shared->obaud;
+        pthread_mutex_unlock(&port->shared->lock);
+    } else if (port) {
+        *baud = dir == SPEED_IN ? port->ibaud : port->obaud;
+    } else {
+        *baud = 0;
+    }
+
+    /* not cached, or changed by another port since termios was read */
+    if (*baud == 0) {
+        return getcustombaud(fd, termios, dir, baud);
+    }
+
+    return 0;
+}
+
+static int push_unsupported_speed(lua_State* L)
+{
+    return push_failure(L, EINVAL, "unsupported speed");
+}
+
+static int setspeed(lua_State* L, cfsetspeedfn* speedfn, int dir)
+{
+    int fd = check_fileno(L, 1);
+    int baud = luaL_checkint(L, 2);
+    int opt = check_when(L, 3);
+    speed_t speed = 0;
+    struct termios termios;
+    pthread_mutex_t* mutex = shared_mutex(L, 1);
+    int ret;
+
+    if (baud2speed(baud, &speed) < 0) {
+        if (baud <= 0) {
+            return push_unsupported_speed(L);
+        }
+        lock_mutex(mutex);
+        ret = setcustombaud(fd, opt, dir & SPEED_IN ? baud : -1, dir & SPEED_OUT ? baud : -1);
+        cached_refresh(L, 1);
+        unlock_mutex(mutex);
+
+        if (ret < 0) {
+            if (errno == ENOTSUP) {
+                return push_unsupported_speed(L);
+            }
+            return push_error(L);
+        }
+    } else {
+        check_tcgetattr(L, fd, &termios);
+
+        if (speedfn(&termios, speed) < 0) {
+            return push_error(L);
+        }
+
+        check_tcsetattr(L, fd, opt, &termios);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int ltermios_cfsetspeed(lua_State* L)
+{
+    return setspeed(L, cfsetspeed, SPEED_IN|SPEED_OUT);
+}
+static int ltermios_cfsetispeed(lua_State* L)
+{
+    return setspeed(L, cfsetispeed, SPEED_IN);
+}
+static int ltermios_cfsetospeed(lua_State* L)
+{
+    return setspeed(L, cfsetospeed, SPEED_OUT);
+}
+
+/*-
+-- speed = termios.cfgetispeed(io)
+-- speed = termios.cfgetospeed(io)
+
+Get speed for input or output.
+
+Speed is the baud rate, which on Linux and OS X may be one without a speed_t.
+
+Returns speed on success, or nil, errmsg, errno on failure.
 
 If errmsg is "unsupported", the errno will be followed by the underlying
 speed_t value returned by the C library, which may be useful for debugging.
 */
 typedef speed_t cfgetspeedfn(const struct termios *termios_p);
 
-static int getspeed(lua_State* L, cfgetspeedfn* speedfn)
+/* pushes the speed, or the error values, and returns their number,
+ * a non-zero custom is a baud rate that has no speed_t */
+static int pushspeed(lua_State* L, speed_t speed, int custom)
+{
+    int baud = custom;
+
+    if (!custom && speed2baud(speed, &baud) < 0) {
+        push_failure(L, ENOTSUP, "unsupported");
+        lua_pushinteger(L, speed);
+        return 4;
+    }
+
+    lua_pushinteger(L, baud);
+
+    return 1;
+}
+
+static int getspeed(lua_State* L, cfgetspeedfn* speedfn, int dir)
+{
+    int fd = check_fileno(L, 1);
+    struct termios termios;
+    speed_t speed;
+    int baud = 0;
+
+    check_tcgetattr(L, fd, &termios);
+
+    speed = speedfn(&termios);
+
+    if (speed2baud(speed, &baud) < 0
+            && cached_getcustombaud(L, 1, fd, &termios, dir, &baud) < 0) {
+        baud = 0;
+    }
+
+    return pushspeed(L, speed, baud);
+}
+
+static int ltermios_cfgetispeed(lua_State* L)
+{
+    return getspeed(L, cfgetispeed, SPEED_IN);
+}
+static int ltermios_cfgetospeed(lua_State* L)
+{
+    return getspeed(L, cfgetospeed, SPEED_OUT);
+}
+
+/*-
+-- io = termios.tcflush(io, direction)
+
+See man page for tcflush()
+
+Direction is either "in", "out", or "both". It defaults to "both".
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_tcflush(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+
+    static const char* opts[] = { "in", "out", "both", NULL };
+    static int opti[] = { TCIFLUSH, TCOFLUSH, TCIOFLUSH };
+
+    int opt = opti[ luaL_checkoption(L, 2, "both", opts) ];
+
+    if(tcflush(fd, opt) < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- io = termios.tcdrain(io).
+
+See man page for tcdrain()
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_tcdrain(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+
+    if(tcdrain(fd) < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- io = termios.tcsendbreak(io, duration).
+
+See man page for tcsendbreak().
+
+Duration is optional, and defaults to zero. If non-zero, its meaning is
+apparently implementation-defined, it might even be ignored.
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_tcsendbreak(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int duration = luaL_optint(L, 2, 0);
+
+    if(tcsendbreak(fd, duration) < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- rs485 = termios.getrs485(io)
+-- io = termios.setrs485(io, rs485)
+
+Get or set the kernel RS-485 mode, see the Linux serial_rs485 documentation.
+When enabled, the driver drives RTS around each transmit, so there is no gap
+between the end of the last byte and the bus turnaround.
+
+The rs485 table has fields:
+- enabled: true if RS-485 mode is on
+- rts_on_send: logical level of RTS while sending
+- rts_after_send: logical level of RTS after sending
+- rx_during_tx: true to receive while sending
+- delay_before: delay in milliseconds between raising RTS and sending
+- delay_after: delay in milliseconds between sending and dropping RTS
+
+For setrs485(), fields that are nil are unchanged.
+
+These are only supported on Linux, and fail with ENOTSUP elsewhere, or
+ENOTTY if the driver doesn't support RS-485.
+
+Returns rs485 or io on success, or nil, errmsg, errno on failure.
+*/
+#if defined(TIOCGRS485) && defined(TIOCSRS485)
+static const struct {
+    const char* name;
+    __u32 flag;
+} rs485_flags[] = {
+    { "enabled",          SER_RS485_ENABLED },
+    { "rts_on_send",      SER_RS485_RTS_ON_SEND },
+    { "rts_after_send",   SER_RS485_RTS_AFTER_SEND },
+    { "rx_during_tx",     SER_RS485_RX_DURING_TX },
+};
+static int RS485_FLAGS = sizeof(rs485_flags)/sizeof(rs485_flags[0]);
+
+static int ltermios_getrs485(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    struct serial_rs485 rs485;
+    int i;
+
+    memset(&rs485, 0, sizeof(rs485));
+
+    if (ioctl(fd, TIOCGRS485, &rs485) < 0) {
+        return push_error(L);
+    }
+
+    lua_createtable(L, 0, RS485_FLAGS + 2);
+
+    for (i = 0; i < RS485_FLAGS; i++) {
+        lua_pushboolean(L, (rs485.flags & rs485_flags[i].flag) != 0);
+        lua_setfield(L, -2, rs485_flags[i].name);
+    }
+
+    lua_pushinteger(L, rs485.delay_rts_before_send);
+    lua_setfield(L, -2, "delay_before");
+    lua_pushinteger(L, rs485.delay_rts_after_send);
+    lua_setfield(L, -2, "delay_after");
+
+    return 1;
+}
+
+static int ltermios_setrs485(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    struct serial_rs485 rs485;
+    int delay;
+    int i;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    memset(&rs485, 0, sizeof(rs485));
+
+    if (ioctl(fd, TIOCGRS485, &rs485) < 0) {
+        return push_error(L);
+    }
+
+    for (i = 0; i < RS485_FLAGS; i++) {
+        int on = opt_field_boolean(L, 2, rs485_flags[i].name);
+
+        if (on > 0) {
+            rs485.flags |= rs485_flags[i].flag;
+        } else if (on == 0) {
+            rs485.flags &= ~rs485_flags[i].flag;
+        }
+    }
+
+    if ((delay = opt_field_int(L, 2, "delay_before", 0, 0x7fffffff)) >= 0) {
+        rs485.delay_rts_before_send = delay;
+    }
+    if ((delay = opt_field_int(L, 2, "delay_after", 0, 0x7fffffff)) >= 0) {
+        rs485.delay_rts_after_send = delay;
+    }
+
+    if (ioctl(fd, TIOCSRS485, &rs485) < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+#else
+static int ltermios_getrs485(lua_State *L)
+{
+    check_fileno(L, 1);
+
+    errno = ENOTSUP;
+
+    return push_error(L);
+}
+
+static int ltermios_setrs485(lua_State *L)
+{
+    check_fileno(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    errno = ENOTSUP;
+
+    return push_error(L);
+}
+#endif
+
+/*-
+-- was = termios.setlowlatency(io[, on])
+
+Set or clear ASYNC_LOW_LATENCY with TIOCSSERIAL, so the driver pushes received
+data to the tty at once instead of deferring it. On defaults to true.
+
+Only supported on Linux, and fails with ENOTSUP elsewhere.
+
+Returns the previous setting, true or false, on success, or nil, errmsg,
+errno on failure.
+*/
+static int ltermios_setlowlatency(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int on = optboolean(L, 2, 1);
+#if defined(TIOCGSERIAL) && defined(TIOCSSERIAL) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct serial;
+    int was;
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) < 0) {
+        return push_error(L);
+    }
+
+    was = (serial.flags & ASYNC_LOW_LATENCY) != 0;
+
+    if (was != on) {
+        if (on) {
+            serial.flags |= ASYNC_LOW_LATENCY;
+        } else {
+            serial.flags &= ~ASYNC_LOW_LATENCY;
+        }
+
+        if (ioctl(fd, TIOCSSERIAL, &serial) < 0) {
+            return push_error(L);
+        }
+    }
+
+    lua_pushboolean(L, was);
+
+    return 1;
+#else
+    (void) fd;
+    (void) on;
+
+    errno = ENOTSUP;
+
+    return push_error(L);
+#endif
+}
+
+/*-
+-- was = termios.latencytimer(io[, ms])
+
+Get, or set if ms is given, the latency timer of the USB-serial adapter
+behind io, such as an FTDI, in milliseconds. This is the time the adapter
+holds a partial packet of received data before sending it to the host.
+
+The timer is the latency_timer attribute of the device in sysfs, so is only
+supported on Linux, and fails with ENOTSUP elsewhere, or ENOENT if the
+device has no latency timer. Setting it usually requires root.
+
+Returns the previous value on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_latencytimer(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int ms = luaL_optint(L, 2, -1);
+#if defined(__linux__)
+    char path[64];
+    struct stat st;
+    FILE* file;
+    int was = -1;
+
+    luaL_argcheck(L, lua_isnoneornil(L, 2) || (ms >= 1 && ms <= 255), 2, "latency timer out of range");
+
+    if (fstat(fd, &st) < 0) {
+        return push_error(L);
+    }
+
+    if (!S_ISCHR(st.st_mode)) {
+        errno = ENOTTY;
+        return push_error(L);
+    }
+
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/latency_timer",
+            major(st.st_rdev), minor(st.st_rdev));
+
+    if ((file = fopen(path, "r")) == NULL) {
+        return push_error(L);
+    }
+
+    if (fscanf(file, "%d", &was) != 1) {
+        fclose(file);
+        errno = EIO;
+        return push_error(L);
+    }
+
+    fclose(file);
+
+    if (ms >= 0 && ms != was) {
+        if ((file = fopen(path, "w")) == NULL) {
+            return push_error(L);
+        }
+
+        fprintf(file, "%d\n", ms);
+
+        if (fclose(file) != 0) {
+            return push_error(L);
+        }
+    }
+
+    lua_pushinteger(L, was);
+
+    return 1;
+#else
+    (void) fd;
+    (void) ms;
+
+    errno = ENOTSUP;
+
+    return push_error(L);
+#endif
+}
+
+/* Modem lines by name, as in termios.modem. */
+#define MODEM(name) { #name, TIOCM_##name }
+
+static const struct {
+    const char* name;
+    int bit;
+} modems[] = {
+    MODEM(LE),
+    MODEM(DTR),
+    MODEM(RTS),
+    MODEM(ST),
+    MODEM(SR),
+    MODEM(CTS),
+    MODEM(CAR),
+    MODEM(RNG),
+    MODEM(DSR),
+#if defined(TIOCM_CD)
+    MODEM(CD),
+#endif
+#if defined(TIOCM_RI)
+    MODEM(RI),
+#endif
+};
+static int MODEMS = sizeof(modems)/sizeof(modems[0]);
+
+#undef MODEM
+
+static int check_modem_name(lua_State* L, int index, const char* name)
+{
+    int i;
+
+    for (i = 0; i < MODEMS; i++) {
+        if (strcmp(modems[i].name, name) == 0) {
+            return modems[i].bit;
+        }
+    }
+
+    return luaL_argerror(L, index, lua_pushfstring(L, "invalid modem line '%s'", name));
+}
+
+/* Modem bits are a number, a line name such as "DTR", or an array of line names. */
+static int check_modem(lua_State* L, int index)
+{
+    int bits = 0;
+    int i;
+
+    if (lua_type(L, index) == LUA_TNUMBER) {
+        return luaL_checkint(L, index);
+    }
+
+    if (lua_type(L, index) != LUA_TTABLE) {
+        return check_modem_name(L, index, luaL_checkstring(L, index));
+    }
+
+    for (i = 1; ; i++) {
+        const char* name;
+
+        lua_rawgeti(L, index, i);
+
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+
+        name = lua_tostring(L, -1);
+
+        if (name == NULL) {
+            luaL_argerror(L, index, "modem lines must be names");
+        }
+
+        bits |= check_modem_name(L, index, name);
+
+        lua_pop(L, 1);
+    }
+
+    return bits;
+}
+
+/*-
+-- bits = termios.tiocmget(io)
+
+Get the modem lines, see termios.modem for the bits.
+
+Returns bits on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_tiocmget(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int bits = 0;
+
+    if (ioctl(fd, TIOCMGET, &bits) < 0) {
+        return push_error(L);
+    }
+
+    lua_pushinteger(L, bits);
+
+    return 1;
+}
+
+static int tiocm(lua_State *L, unsigned long request)
+{
+    int fd = check_fileno(L, 1);
+    int bits = check_modem(L, 2);
+
+    if (ioctl(fd, request, &bits) < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- io = termios.tiocmset(io, bits)
+-- io = termios.tiocmbis(io, bits)
+-- io = termios.tiocmbic(io, bits)
+
+Set the modem lines to bits, or set or clear only the lines in bits.
+
+Bits is a number, a line name such as "DTR" or "RTS", or an array of line
+names. The line names are the keys of termios.modem.
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_tiocmset(lua_State *L)
+{
+    return tiocm(L, TIOCMSET);
+}
+
+static int ltermios_tiocmbis(lua_State *L)
+{
+    return tiocm(L, TIOCMBIS);
+}
+
+static int ltermios_tiocmbic(lua_State *L)
+{
+    return tiocm(L, TIOCMBIC);
+}
+
+/*-
+-- bits = termios.waitmodem(io, mask[, timeout])
+
+Wait for any of the modem lines in mask to change, mask is as for
+termios.tiocmset(), and is usually some of "CTS", "DSR", "CD", and "RI".
+
+This blocks in the TIOCMIWAIT ioctl, which wakes on the line change interrupt
+from the driver. TIOCMIWAIT can't be timed out, so with a timeout in
+milliseconds it runs on a helper thread, as for termios.modemchange(), and the
+wait is for that. When the timeout expires the thread is interrupted with the
+signal SIGRTMAX - 1, if the application hasn't set a disposition for it. Where TIOCMIWAIT isn't supported (except on Linux) the lines
+are sampled with TIOCMGET every millisecond instead.
+
+Returns the modem bits after the change on success, nil, "timeout",
+ETIMEDOUT if the timeout expires first, or nil, errmsg, errno on failure.
+*/
+#if defined(TIOCMIWAIT) && defined(SIGRTMAX)
+/* A helper thread's TIOCMIWAIT is cancelled by interrupting it with this signal, from
+ * a handler without SA_RESTART. It is only installed, and sent, if the signal has its
+ * default disposition, so an application's use of it is left alone. */
+#define MODEM_CANCEL_SIGNAL (SIGRTMAX - 1)
+
+static int modem_cancel_installed;
+static pthread_once_t modem_cancel_once = PTHREAD_ONCE_INIT;
+
+static void modem_cancel_handler(int sig)
+{
+    (void) sig;
+}
+
+static void modem_cancel_init(void)
+{
+    struct sigaction sa;
+
+    if (sigaction(MODEM_CANCEL_SIGNAL, NULL, &sa) < 0
+            || (sa.sa_flags & SA_SIGINFO) || sa.sa_handler != SIG_DFL) {
+        return;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = modem_cancel_handler;
+    sigemptyset(&sa.sa_mask);
+
+    modem_cancel_installed = sigaction(MODEM_CANCEL_SIGNAL, &sa, NULL) == 0;
+}
+#endif
+
+/* Block until a modem line in mask changes, stopping early with ECANCELED if
+ * cancelled is set. Returns 0 with the bits after the change, or -1 with errno set. */
+static int modem_wait(int fd, int mask, atomic_int* cancelled, int* bits)
+{
+#if defined(TIOCMIWAIT)
+    int ret;
+
+    do {
+        if (cancelled && atomic_load(cancelled)) {
+            errno = ECANCELED;
+            return -1;
+        }
+        ret = ioctl(fd, TIOCMIWAIT, mask);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    return ioctl(fd, TIOCMGET, bits);
+#else
+    static const struct timespec tick = { 0, 1000000L };
+    int start = 0;
+
+    if (ioctl(fd, TIOCMGET, &start) < 0) {
+        return -1;
+    }
+
+    do {
+        nanosleep(&tick, NULL);
+
+        if (cancelled && atomic_load(cancelled)) {
+            errno = ECANCELED;
+            return -1;
+        }
+
+        if (ioctl(fd, TIOCMGET, bits) < 0) {
+            return -1;
+        }
+    } while (!((*bits ^ start) & mask));
+
+    return 0;
+#endif
+}
+
+/* in the termios.drain() section, as the helper thread is the same */
+static int push_modem_wait(lua_State* L, int fd, int mask, const struct timespec* deadline);
+
+static int ltermios_waitmodem(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int mask = check_modem(L, 2);
+    struct timespec deadline;
+    int bits = 0;
+
+    if (opt_deadline(L, 3, &deadline)) {
+        return push_modem_wait(L, fd, mask, &deadline);
+    }
+
+    if (modem_wait(fd, mask, NULL, &bits) < 0) {
+        return push_error(L);
+    }
+
+    lua_pushinteger(L, bits);
+
+    return 1;
+}
+
+/*-
+-- io = termios.cfraw(io, when)
+
+See man page for cfmakeraw()
+
+When is "now", "drain", or "flush". Default is "flush".
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_cfraw(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int opt = check_when(L, 2);
+    struct termios termios;
+
+    check_tcgetattr(L, fd, &termios);
+
+    cfmakeraw(&termios);
+
+    check_tcsetattr(L, fd, opt, &termios);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- io = termios.setflowcontrol(io, flow, when)
+
+Set flow control, flow is one of:
+- "none": no flow control
+- "hardware": RTS/CTS, with CRTSCTS
+- "software": XON/XOFF, with IXON and IXOFF
+- "both": hardware and software
+
+Hardware flow control fails with ENOTSUP where CRTSCTS isn't defined.
+
+When is "now", "drain", or "flush". Default is "flush".
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+#define FLOW_HARDWARE 1
+#define FLOW_SOFTWARE 2
+
+static const char* flow_opts[] = { "none", "hardware", "software", "both", NULL };
+
+static int check_flow(lua_State* L, int index)
+{
+    return luaL_checkoption(L, index, NULL, flow_opts);
+}
+
+/* returns 0 on success, or -1 with errno set */
+static int setflowbits(struct termios* termios, int flow)
+{
+#if defined(CRTSCTS)
+    if (flow & FLOW_HARDWARE) {
+        termios->c_cflag |= CRTSCTS;
+    } else {
+        termios->c_cflag &= ~CRTSCTS;
+    }
+#else
+    if (flow & FLOW_HARDWARE) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+
+    if (flow & FLOW_SOFTWARE) {
+        termios->c_iflag |= IXON|IXOFF;
+    } else {
+        termios->c_iflag &= ~(IXON|IXOFF|IXANY);
+    }
+
+    return 0;
+}
+
+static int getflowbits(const struct termios* termios)
+{
+    int flow = 0;
+
+#if defined(CRTSCTS)
+    if ((termios->c_cflag & CRTSCTS) == CRTSCTS) {
+        flow |= FLOW_HARDWARE;
+    }
+#endif
+    if (termios->c_iflag & (IXON|IXOFF)) {
+        flow |= FLOW_SOFTWARE;
+    }
+
+    return flow;
+}
+
+static int ltermios_setflowcontrol(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int flow = check_flow(L, 2);
+    int opt = check_when(L, 3);
+    struct termios termios;
+
+    check_tcgetattr(L, fd, &termios);
+
+    if (setflowbits(&termios, flow) < 0) {
+        return push_error(L);
+    }
+
+    check_tcsetattr(L, fd, opt, &termios);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- io = termios.setvmin(io, vmin[, vtime[, when]])
+
+Set the VMIN and VTIME control characters, which decide when a read in
+non-canonical mode returns, see the man page for termios.
+
+Vmin is the number of bytes the kernel waits for, and vtime is the inter-byte
+timeout in tenths of a second, which defaults to zero. Both range from 0 to 255.
+For example, a vmin of 255 and a vtime of 1 collects bytes until either 255 have
+arrived, or until the line has been idle for 0.1 seconds after the first byte.
+
+When is "now", "drain", or "flush". Default is "flush".
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static void check_vmin(lua_State* L, int index, struct termios* termios)
+{
+    int vmin = luaL_checkint(L, index);
+    int vtime = luaL_optint(L, index + 1, 0);
+
+    luaL_argcheck(L, vmin >= 0 && vmin <= 255, index, "out of range");
+    luaL_argcheck(L, vtime >= 0 && vtime <= 255, index + 1, "out of range");
+
+    termios->c_cc[VMIN] = vmin;
+    termios->c_cc[VTIME] = vtime;
+}
+
+static int ltermios_setvmin(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    int opt = check_when(L, 4);
+    struct termios termios;
+
+    check_tcgetattr(L, fd, &termios);
+
+    check_vmin(L, 2, &termios);
+
+    check_tcsetattr(L, fd, opt, &termios);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- attr = termios.tcgetattr(io)
+
+Get the terminal attributes as a termios userdata, see the attr methods below.
+
+Changes to attr are made in memory only, none of them affect the terminal until
+attr is applied with termios.tcsetattr(), so any number of changes costs a single
+tcsetattr() system call.
+
+Returns attr on success, or nil, errmsg, errno on failure.
+*/
+struct attr {
+    struct termios termios;
+    /* baud rates that have no speed_t, or zero */
+    int ibaud;
+    int obaud;
+    /* for merging changes into a shared port, see shared_tcsetattr() */
+    const struct shared_port* shared; /* read from, or NULL */
+    struct termios seen; /* as read */
+};
+
+static struct attr* check_attr(lua_State* L, int index)
+{
+    return luaL_checkudata(L, index, REGID);
+}
+
+static struct attr* push_attr(lua_State* L, const struct termios* termios)
+{
+    struct attr* attr = lua_newuserdata(L, sizeof(*attr));
+
+    memset(attr, 0, sizeof(*attr));
+    attr->termios = *termios;
+
+    luaL_getmetatable(L, REGID);
+    lua_setmetatable(L, -2);
+
+    return attr;
+}
+
+static int ltermios_tcgetattr(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct termios termios;
+    struct attr* attr;
+    struct port* port;
+    int baud;
+
+    check_tcgetattr(L, fd, &termios);
+
+    attr = push_attr(L, &termios);
+    attr->seen = termios;
+    if ((port = test_udata(L, 1, PORTID)) != NULL) {
+        attr->shared = port->shared;
+    }
+
+    if (speed2baud(cfgetispeed(&termios), &baud) < 0) {
+        cached_getcustombaud(L, 1, fd, &termios, SPEED_IN, &attr->ibaud);
+    }
+    if (speed2baud(cfgetospeed(&termios), &baud) < 0) {
+        cached_getcustombaud(L, 1, fd, &termios, SPEED_OUT, &attr->obaud);
+    }
+
+    return 1;
+}
+
+/*-
+-- io = termios.tcsetattr(io, attr, when)
+
+Set the terminal attributes from attr, a termios userdata.
+
+When is "now", "drain", or "flush". Default is "flush".
+
+Returns io on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_tcsetattr(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct attr* attr = check_attr(L, 2);
+    int opt = check_when(L, 3);
+    struct port* port = test_udata(L, 1, PORTID);
+    pthread_mutex_t* mutex = shared_mutex(L, 1);
+    int ret;
+
+    /* locked so the attributes and a custom baud rate are set together */
+    lock_mutex(mutex);
+
+    if (port && port->shared) {
+        /* merged against the attributes attr was read as, an attr from another
+         * device overwrites them */
+        ret = shared_tcsetattr(port, opt, attr->shared == port->shared ? &attr->seen : NULL,
+                &attr->termios);
+    } else {
+        ret = cached_tcsetattr(L, 1, fd, opt, &attr->termios);
+    }
+
+    if (ret == 0 && (attr->ibaud || attr->obaud)) {
+        ret = setcustombaud(fd, TCSANOW, attr->ibaud ? attr->ibaud : -1, attr->obaud ? attr->obaud : -1);
+        cached_refresh(L, 1);
+    }
+
+    unlock_mutex(mutex);
+
+    if (ret < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- attr = attr:cfsetspeed(speed)
+-- attr = attr:cfsetispeed(speed)
+-- attr = attr:cfsetospeed(speed)
+
+Set speed for input and output, input only, or output only, see termios.cfsetspeed().
+
+Returns attr on success, or nil, errmsg, errno on failure.
+*/
+static int attrsetspeed(lua_State* L, cfsetspeedfn* speedfn, int dir)
+{
+    struct attr* attr = check_attr(L, 1);
+    int baud = luaL_checkint(L, 2);
+    speed_t speed = 0;
+
+    if (baud2speed(baud, &speed) < 0) {
+#if defined(__linux__) || defined(__APPLE__)
+        if (baud <= 0) {
+            return push_unsupported_speed(L);
+        }
+#else
+        return push_unsupported_speed(L);
+#endif
+    } else if (speedfn(&attr->termios, speed) < 0) {
+        return push_error(L);
+    } else {
+        baud = 0;
+    }
+
+    if (dir & SPEED_IN) {
+        attr->ibaud = baud;
+    }
+    if (dir & SPEED_OUT) {
+        attr->obaud = baud;
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int lattr_cfsetspeed(lua_State* L)
+{
+    return attrsetspeed(L, cfsetspeed, SPEED_IN|SPEED_OUT);
+}
+static int lattr_cfsetispeed(lua_State* L)
+{
+    return attrsetspeed(L, cfsetispeed, SPEED_IN);
+}
+static int lattr_cfsetospeed(lua_State* L)
+{
+    return attrsetspeed(L, cfsetospeed, SPEED_OUT);
+}
+
+/*-
+-- speed = attr:cfgetispeed()
+-- speed = attr:cfgetospeed()
+
+Get speed for input or output, see termios.cfgetispeed().
+*/
+static int lattr_cfgetispeed(lua_State* L)
+{
+    struct attr* attr = check_attr(L, 1);
+
+    return pushspeed(L, cfgetispeed(&attr->termios), attr->ibaud);
+}
+static int lattr_cfgetospeed(lua_State* L)
+{
+    struct attr* attr = check_attr(L, 1);
+
+    return pushspeed(L, cfgetospeed(&attr->termios), attr->obaud);
+}
+
+/*-
+-- attr = attr:cfraw()
+
+See man page for cfmakeraw()
+
+Returns attr.
+*/
+static int lattr_cfraw(lua_State* L)
+{
+    cfmakeraw(&check_attr(L, 1)->termios);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- attr = attr:setcanonical(canonical)
+
+Turns canonical mode on and off. Canonical defaults to true.
+
+Returns attr.
+*/
+static int lattr_setcanonical(lua_State* L)
+{
+    setcanonical(&check_attr(L, 1)->termios, optboolean(L, 2, 1));
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/* Flags by name, value is the offset of the flag's member of struct termios. */
+#define FLAG(member, flag) { #flag, offsetof(struct termios, member), flag }
+
+static const struct {
+    const char* name;
+    size_t offset;
+    tcflag_t flag;
+} flags[] = {
+    FLAG(c_iflag, IGNBRK),
+    FLAG(c_iflag, BRKINT),
+    FLAG(c_iflag, IGNPAR),
+    FLAG(c_iflag, PARMRK),
+    FLAG(c_iflag, INPCK),
+    FLAG(c_iflag, ISTRIP),
+    FLAG(c_iflag, INLCR),
+    FLAG(c_iflag, IGNCR),
+    FLAG(c_iflag, ICRNL),
+    FLAG(c_iflag, IXON),
+    FLAG(c_iflag, IXOFF),
+    FLAG(c_iflag, IXANY),
+    FLAG(c_oflag, OPOST),
+    FLAG(c_oflag, ONLCR),
+    FLAG(c_oflag, OCRNL),
+    FLAG(c_cflag, CSTOPB),
+    FLAG(c_cflag, CREAD),
+    FLAG(c_cflag, PARENB),
+    FLAG(c_cflag, PARODD),
+    FLAG(c_cflag, HUPCL),
+    FLAG(c_cflag, CLOCAL),
+#if defined(CRTSCTS)
+    FLAG(c_cflag, CRTSCTS),
+#endif
+    FLAG(c_lflag, ISIG),
+    FLAG(c_lflag, ICANON),
+    FLAG(c_lflag, ECHO),
+    FLAG(c_lflag, ECHOE),
+    FLAG(c_lflag, ECHOK),
+    FLAG(c_lflag, ECHONL),
+    FLAG(c_lflag, NOFLSH),
+    FLAG(c_lflag, TOSTOP),
+    FLAG(c_lflag, IEXTEN),
+};
+static int FLAGS = sizeof(flags)/sizeof(flags[0]);
+
+#undef FLAG
+
+static tcflag_t* check_flag(lua_State* L, struct termios* termios, int index, tcflag_t* flag)
+{
+    const char* name = luaL_checkstring(L, index);
+    int i;
+
+    for (i = 0; i < FLAGS; i++) {
+        if (strcmp(flags[i].name, name) == 0) {
+            *flag = flags[i].flag;
+            return (tcflag_t*) ((char*) termios + flags[i].offset);
+        }
+    }
+
+    luaL_argerror(L, index, lua_pushfstring(L, "invalid flag '%s'", name));
+
+    return NULL;
+}
+
+/*-
+-- on = attr:getflag(name)
+-- attr = attr:setflag(name, on)
+
+Get or set a flag by name, such as "ECHO" or "CLOCAL". On defaults to true.
+
+For the meaning of the flags, see the man page for termios.
+*/
+static int lattr_getflag(lua_State* L)
+{
+    struct attr* attr = check_attr(L, 1);
+    tcflag_t flag = 0;
+    tcflag_t* member = check_flag(L, &attr->termios, 2, &flag);
+
+    lua_pushboolean(L, (*member & flag) != 0);
+
+    return 1;
+}
+
+static int lattr_setflag(lua_State* L)
+{
+    struct attr* attr = check_attr(L, 1);
+    tcflag_t flag = 0;
+    tcflag_t* member = check_flag(L, &attr->termios, 2, &flag);
+
+    if (optboolean(L, 3, 1)) {
+        *member |= flag;
+    } else {
+        *member &= ~flag;
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int check_cc(lua_State* L, int index)
+{
+    static const char* opts[] = {
+        "VEOF", "VEOL", "VERASE", "VINTR", "VKILL", "VMIN", "VQUIT",
+        "VSTART", "VSTOP", "VSUSP", "VTIME", NULL
+    };
+    static int opti[] = {
+        VEOF, VEOL, VERASE, VINTR, VKILL, VMIN, VQUIT,
+        VSTART, VSTOP, VSUSP, VTIME
+    };
+
+    return opti[ luaL_checkoption(L, index, NULL, opts) ];
+}
+
+/*-
+-- value = attr:getcc(name)
+-- attr = attr:setcc(name, value)
+
+Get or set a control character, name is one of "VEOF", "VEOL", "VERASE", "VINTR",
+"VKILL", "VMIN", "VQUIT", "VSTART", "VSTOP", "VSUSP", or "VTIME".
+
+Values are numbers from 0 to 255.
+*/
+static int lattr_getcc(lua_State* L)
+{
+    struct attr* attr = check_attr(L, 1);
+    int cc = check_cc(L, 2);
+
+    lua_pushinteger(L, attr->termios.c_cc[cc]);
+
+    return 1;
+}
+
+static int lattr_setcc(lua_State* L)
+{
+    struct attr* attr = check_attr(L, 1);
+    int cc = check_cc(L, 2);
+    int value = luaL_checkint(L, 3);
+
+    luaL_argcheck(L, value >= 0 && value <= 255, 3, "out of range");
+
+    attr->termios.c_cc[cc] = value;
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- attr = attr:setvmin(vmin[, vtime])
+-- vmin, vtime = attr:getvmin()
+
+Set or get the VMIN and VTIME control characters, see termios.setvmin().
+*/
+static int lattr_setvmin(lua_State* L)
+{
+    check_vmin(L, 2, &check_attr(L, 1)->termios);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int lattr_getvmin(lua_State* L)
+{
+    struct attr* attr = check_attr(L, 1);
+
+    lua_pushinteger(L, attr->termios.c_cc[VMIN]);
+    lua_pushinteger(L, attr->termios.c_cc[VTIME]);
+
+    return 2;
+}
+
+/*-
+-- attr = attr:setflowcontrol(flow)
+-- flow = attr:getflowcontrol()
+
+Set or get flow control, see termios.setflowcontrol().
+
+Returns attr on success, or nil, errmsg, errno on failure.
+*/
+static int lattr_setflowcontrol(lua_State* L)
+{
+    struct attr* attr = check_attr(L, 1);
+
+    if (setflowbits(&attr->termios, check_flow(L, 2)) < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int lattr_getflowcontrol(lua_State* L)
+{
+    lua_pushstring(L, flow_opts[getflowbits(&check_attr(L, 1)->termios)]);
+
+    return 1;
+}
+
+static const luaL_reg attr_methods[] =
+{
+    {"cfsetspeed",        lattr_cfsetspeed},
+    {"cfsetispeed",       lattr_cfsetispeed},
+    {"cfsetospeed",       lattr_cfsetospeed},
+    {"cfgetispeed",       lattr_cfgetispeed},
+    {"cfgetospeed",       lattr_cfgetospeed},
+    {"cfraw",             lattr_cfraw},
+    {"setcanonical",      lattr_setcanonical},
+    {"getflag",           lattr_getflag},
+    {"setflag",           lattr_setflag},
+    {"getcc",             lattr_getcc},
+    {"setcc",             lattr_setcc},
+    {"setvmin",           lattr_setvmin},
+    {"getvmin",           lattr_getvmin},
+    {"setflowcontrol",    lattr_setflowcontrol},
+    {"getflowcontrol",    lattr_getflowcontrol},
+    {NULL, NULL}
+};
+
+/*-
+-- fd = termios.open(path)
+
+The path must exist, and is opened read-write.
+
+See below for termios.open(path, opts), which returns a port.
+
+Returns fd on success, or nil, errmsg, errno on failure.
+*/
+static int open_port(lua_State* L, const char* path, int index);
+static int lport_close(lua_State* L);
+
+/* Could I depend on luaposix for this? */
+static int ltermios_open(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+    int fd;
+
+    if (!lua_isnoneornil(L, 2)) {
+        return open_port(L, path, 2);
+    }
+
+    fd = open(path, O_NOCTTY|O_RDWR);
+
+    if (fd < 0) {
+        return push_error(L);
+    }
+
+    lua_pushinteger(L, fd);
+
+    return 1;
+}
+
+/*-
+-- termios.close(fd)
+
+Close an fd, which must be a number or a port, not an io object.
+
+Returns nothing on success, or nil, errmsg, errno on failure.
+*/
+/* the fd number will be reused, so forget any buffered frame */
+static void forget_frames(lua_State* L, int fd)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, FRAMESID);
+    if (lua_istable(L, -1)) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, fd);
+    }
+    lua_pop(L, 1);
+}
+
+static int ltermios_close(lua_State *L)
+{
+    int fd;
+
+    if (test_udata(L, 1, PORTID)) {
+        return lport_close(L);
+    }
+
+    fd = luaL_checkint(L, 1);
+
+    forget_frames(L, fd);
+
+    if (close(fd) < 0) {
+            return push_error(L);
+    }
+
+    return 0;
+}
+
+/*-
+-- results = termios.configure_all(ios, profile)
+
+Apply a profile to many ios at once, each with a single tcsetattr(). The ios is an
+array of io objects, fd numbers, or paths, and paths are opened as by termios.open().
+
+Profile is a table, with every field optional:
+- raw: true to apply cfmakeraw()
+- canonical: true or false to turn canonical mode on or off, after raw
+- speed: the baud rate, for both input and output
+- vmin, vtime: see termios.setvmin()
+- flow: see termios.setflowcontrol()
+- blocking: true or false, see termios.setblocking()
+- when: "now", "drain", or "flush". Default is "flush".
+- threads: the number of threads to configure ios with, default is 1. Some drivers
+  block for milliseconds in tcsetattr(), and threads spread that wait out.
+
+Returns an array of results, in the same order as ios. Each result is a table with
+an fd field, which for a path is the fd that was opened, and on failure err and
+errno fields. A path that fails to be configured is closed, and its fd is nil.
+*/
+struct profile {
+    /* -1 is unchanged */
+    int raw;
+    int canonical;
+    int baud;
+    int vmin;
+    int vtime;
+    int flow;
+    int blocking;
+    int when;
+};
+
+struct job {
+    const char* path; /* NULL if fd is already open */
+    int fd;
+    int err; /* errno, or zero on success */
+    pthread_mutex_t* lock; /* of a shared port, or NULL */
+};
+
+/* a profile that changes nothing */
+static void profile_none(struct profile* profile)
+{
+    profile->raw = profile->canonical = profile->baud = profile->vmin = profile->vtime = -1;
+    profile->flow = profile->blocking = -1;
+    profile->when = TCSANOW;
+}
+
+static void check_profile(lua_State* L, int index, struct profile* profile)
+{
+    speed_t speed;
+
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    profile->raw = opt_field_boolean(L, index, "raw");
+    profile->canonical = opt_field_boolean(L, index, "canonical");
+    profile->baud = opt_field_int(L, index, "speed", 0, 0x7fffffff);
+    profile->vmin = opt_field_int(L, index, "vmin", 0, 255);
+    profile->vtime = opt_field_int(L, index, "vtime", 0, 255);
+    profile->blocking = opt_field_boolean(L, index, "blocking");
+
+    lua_getfield(L, index, "flow");
+    profile->flow = lua_isnil(L, -1) ? -1 : check_flow(L, lua_gettop(L));
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "when");
+    profile->when = check_when(L, lua_gettop(L));
+    lua_pop(L, 1);
+
+#if !defined(__linux__) && !defined(__APPLE__)
+    if (profile->baud >= 0 && baud2speed(profile->baud, &speed) < 0) {
+        luaL_error(L, "profile field 'speed' is an unsupported speed");
+    }
+#else
+    (void) speed;
+#endif
+}
+
+/* Apply profile to fd, it touches no Lua state, so can run on any thread.
+ * Returns 0 on success, or -1 with errno set. */
+static int profile_apply(int fd, const struct profile* profile)
+{
+    if (profile->raw > 0 || profile->canonical >= 0 || profile->baud >= 0
+            || profile->vmin >= 0 || profile->vtime >= 0 || profile->flow >= 0) {
+        struct termios termios;
+        speed_t speed = 0;
+        int custom = 0;
+
+        if (tcgetattr(fd, &termios) < 0) {
+            return -1;
+        }
+
+        if (profile->raw > 0) {
+            cfmakeraw(&termios);
+        }
+        if (profile->canonical >= 0) {
+            setcanonical(&termios, profile->canonical);
+        }
+        if (profile->vmin >= 0) {
+            termios.c_cc[VMIN] = profile->vmin;
+        }
+        if (profile->vtime >= 0) {
+            termios.c_cc[VTIME] = profile->vtime;
+        }
+        if (profile->flow >= 0 && setflowbits(&termios, profile->flow) < 0) {
+            return -1;
+        }
+        if (profile->baud >= 0) {
+            if (baud2speed(profile->baud, &speed) < 0) {
+                custom = 1;
+            } else if (cfsetspeed(&termios, speed) < 0) {
+                return -1;
+            }
+        }
+
+        if (tcsetattr(fd, profile->when, &termios) < 0) {
+            return -1;
+        }
+
+        if (custom && setcustombaud(fd, TCSANOW, profile->baud, profile->baud) < 0) {
+            return -1;
+        }
+    }
+
+    if (profile->blocking >= 0) {
+        int flags = fcntl(fd, F_GETFL);
+
+        if (flags < 0) {
+            return -1;
+        }
+
+        if (profile->blocking) {
+            flags &= ~O_NONBLOCK;
+        } else {
+            flags |= O_NONBLOCK;
+        }
+
+        if (fcntl(fd, F_SETFL, flags) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void job_run(struct job* job, const struct profile* profile)
+{
+    if (job->path) {
+        job->fd = open(job->path, O_NOCTTY|O_RDWR);
+
+        if (job->fd < 0) {
+            job->err = errno;
+            return;
+        }
+    }
+
+    lock_mutex(job->lock);
+    if (profile_apply(job->fd, profile) < 0) {
+        job->err = errno;
+    }
+    unlock_mutex(job->lock);
+
+    if (job->err && job->path) {
+        close(job->fd);
+        job->fd = -1;
+    }
+}
+
+struct worker {
+    pthread_t thread;
+    struct job* jobs;
+    int count;
+    int stride;
+    const struct profile* profile;
+};
+
+static void* worker_run(void* arg)
+{
+    struct worker* worker = arg;
+    int i;
+
+    for (i = 0; i < worker->count; i += worker->stride) {
+        job_run(&worker->jobs[i], worker->profile);
+    }
+
+    return NULL;
+}
+
+static int ltermios_configure_all(lua_State* L)
+{
+    struct profile profile;
+    struct job* jobs;
+    struct worker* workers;
+    int threads;
+    int count;
+    int i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    check_profile(L, 2, &profile);
+
+    threads = opt_field_int(L, 2, "threads", 1, 1024);
+    count = lua_objlen(L, 1);
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > count && count > 0) {
+        threads = count;
+    }
+
+    /* as userdata, they are collected even if an argument error is raised */
+    jobs = lua_newuserdata(L, count * sizeof(*jobs) + 1);
+    workers = lua_newuserdata(L, threads * sizeof(*workers) + 1);
+
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+
+        jobs[i].err = 0;
+        jobs[i].fd = -1;
+        jobs[i].path = NULL;
+        jobs[i].lock = shared_mutex(L, -1);
+
+        /* the path strings are referenced by ios until the function returns */
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            jobs[i].path = lua_tostring(L, -1);
+        } else {
+            jobs[i].fd = check_fileno(L, -1);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    for (i = 0; i < threads; i++) {
+        workers[i].jobs = jobs + i;
+        workers[i].count = count - i;
+        workers[i].stride = threads;
+        workers[i].profile = &profile;
+    }
+
+    /* the calling thread is the first worker, and also runs any that fail to start */
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            workers[i].stride = 0;
+        }
+    }
+
+    worker_run(&workers[0]);
+
+    for (i = 1; i < threads; i++) {
+        if (workers[i].stride == 0) {
+            workers[i].stride = threads;
+            worker_run(&workers[i]);
+        } else {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    lua_createtable(L, count, 0);
+
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        cached_refresh(L, lua_gettop(L));
+        lua_pop(L, 1);
+
+        lua_createtable(L, 0, 3);
+
+        if (jobs[i].fd >= 0) {
+            lua_pushinteger(L, jobs[i].fd);
+            lua_setfield(L, -2, "fd");
+        }
+        if (jobs[i].err) {
+            push_errmsg(L, jobs[i].err, NULL);
+            lua_setfield(L, -2, "err");
+            lua_pushinteger(L, jobs[i].err);
+            lua_setfield(L, -2, "errno");
+        }
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+/*-
+-- master, slave, path = termios.openpty([profile])
+
+Open a new pseudo-terminal pair, with posix_openpt(), and configure the slave with
+profile, as for termios.configure_all(). The fds are numbers, and are closed with
+termios.close(). The slave is the end a program under test would open as a serial
+port, path is its name, and the master is the device end.
+
+Returns master, slave, path on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_openpty(lua_State* L)
+{
+    struct profile profile;
+    char path[128];
+    int master;
+    int slave = -1;
+    int err;
+
+    if (!lua_isnoneornil(L, 1)) {
+        check_profile(L, 1, &profile);
+    } else {
+        profile_none(&profile);
+    }
+
+    if ((master = posix_openpt(O_RDWR|O_NOCTTY)) < 0) {
+        return push_error(L);
+    }
+
+    if (grantpt(master) < 0 || unlockpt(master) < 0) {
+        goto fail;
+    }
+
+#if defined(__linux__)
+    if ((err = ptsname_r(master, path, sizeof(path))) != 0) {
+        errno = err;
+        goto fail;
+    }
+#else
+    {
+        const char* name = ptsname(master);
+
+        if (name == NULL) {
+            goto fail;
+        }
+
+        snprintf(path, sizeof(path), "%s", name);
+    }
+#endif
+
+    if ((slave = open(path, O_RDWR|O_NOCTTY)) < 0 || profile_apply(slave, &profile) < 0) {
+        goto fail;
+    }
+
+    lua_pushinteger(L, master);
+    lua_pushinteger(L, slave);
+    lua_pushstring(L, path);
+
+    return 3;
+
+fail:
+    err = errno;
+    if (slave >= 0) {
+        close(slave);
+    }
+    close(master);
+    errno = err;
+
+    return push_error(L);
+}
+
+/*
+Io threads: a port opened with the thread option has a native thread that moves
+bytes between the device and a pair of lock-free single-producer single-consumer
+rings, so the device is drained even while the Lua state is busy, for example
+collecting garbage. The thread produces into rx and consumes from tx, and the
+Lua state does the opposite.
+*/
+struct ring {
+    char* data;
+    size_t size; /* a power of two */
+    atomic_size_t head; /* only advanced by the consumer */
+    atomic_size_t tail; /* only advanced by the producer */
+};
+
+struct io_thread {
+    pthread_t thread;
+    int fd;
+    int wake[2]; /* written by Lua to wake the thread, when there is data to transmit or to stop it */
+    int notify[2]; /* written by the thread, when there is data received */
+    int space[2]; /* written by the thread, when it frees space in tx */
+    struct ring rx;
+    struct ring tx;
+    atomic_int stop;
+    atomic_int notified; /* notify has been written, and not yet drained */
+    atomic_int spaced; /* space has been written, and not yet drained */
+    atomic_int eof;
+    atomic_int err; /* the errno that stopped the thread, or zero */
+    atomic_ulong rx_bytes;
+    atomic_ulong tx_bytes;
+    atomic_ulong rx_overruns; /* bytes received while rx was full, and dropped */
+};
+
+#define RING_SIZE 65536
+
+static int ring_init(struct ring* ring, size_t size)
+{
+    size_t pow2 = 1;
+
+    while (pow2 < size) {
+        pow2 <<= 1;
+    }
+
+    ring->data = malloc(pow2);
+    ring->size = pow2;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return ring->data ? 0 : -1;
+}
+
+/* the number of bytes in the ring, from either side */
+static size_t ring_used(struct ring* ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return tail - head;
+}
+
+/* producer: returns the contiguous free space, and where it starts */
+static size_t ring_space(struct ring* ring, char** p)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t off = tail & (ring->size - 1);
+    size_t space = ring->size - (tail - head);
+
+    *p = ring->data + off;
+
+    return space < ring->size - off ? space : ring->size - off;
+}
+
+/* producer: publish n bytes written to the free space */
+static void ring_commit(struct ring* ring, size_t n)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
+
+/* consumer: returns the contiguous used space, and where it starts */
+static size_t ring_peek(struct ring* ring, char** p)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t off = head & (ring->size - 1);
+    size_t used = tail - head;
+
+    *p = ring->data + off;
+
+    return used < ring->size - off ? used : ring->size - off;
+}
+
+/* consumer: release n bytes read from the used space */
+static void ring_release(struct ring* ring, size_t n)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+}
+
+static size_t ring_put(struct ring* ring, const char* data, size_t n)
+{
+    size_t done = 0;
+
+    /* at most twice, when the free space wraps */
+    while (done < n) {
+        char* p;
+        size_t space = ring_space(ring, &p);
+
+        if (space == 0) {
+            break;
+        }
+        if (space > n - done) {
+            space = n - done;
+        }
+
+        memcpy(p, data + done, space);
+        ring_commit(ring, space);
+        done += space;
+    }
+
+    return done;
+}
+
+static size_t ring_get(struct ring* ring, char* data, size_t n)
+{
+    size_t done = 0;
+
+    while (done < n) {
+        char* p;
+        size_t used = ring_peek(ring, &p);
+
+        if (used == 0) {
+            break;
+        }
+        if (used > n - done) {
+            used = n - done;
+        }
+
+        memcpy(data + done, p, used);
+        ring_release(ring, used);
+        done += used;
+    }
+
+    return done;
+}
+
+static void drain_pipe(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+static int pipe_nonblocking(int fds[2])
+{
+    int i;
+
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    return 0;
+}
+
+/* write a pipe to make it readable, unless flag says it already is */
+static void signal_pipe(atomic_int* flag, int fd)
+{
+    if (!atomic_exchange(flag, 1)) {
+        if (write(fd, "", 1) < 0) {
+            /* a full pipe is already readable */
+        }
+    }
+}
+
+/* drain a pipe written by signal_pipe(), before checking what it signals */
+static void unsignal_pipe(atomic_int* flag, int fd)
+{
+    /* drained before clearing, so a signal from in between isn't eaten */
+    if (atomic_load(flag)) {
+        drain_pipe(fd);
+        atomic_store(flag, 0);
+    }
+}
+
+static void io_thread_notify(struct io_thread* io)
+{
+    signal_pipe(&io->notified, io->notify[1]);
+}
+
+static void io_thread_space(struct io_thread* io)
+{
+    signal_pipe(&io->spaced, io->space[1]);
+}
+
+static void* io_thread_run(void* arg)
+{
+    struct io_thread* io = arg;
+    char scratch[512];
+
+    while (!atomic_load(&io->stop)) {
+        struct pollfd pfd[2];
+        int eof = atomic_load(&io->eof);
+        short events = (eof ? 0 : POLLIN) | (ring_used(&io->tx) ? POLLOUT : 0);
+
+        /* after eof, a hung up fd would always be ready */
+        pfd[0].fd = events ? io->fd : -1;
+        pfd[0].events = events;
+        pfd[0].revents = 0;
+        pfd[1].fd = io->wake[0];
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            atomic_store(&io->err, errno);
+            break;
+        }
+
+        if (pfd[1].revents) {
+            drain_pipe(io->wake[0]);
+        }
+
+        if (!eof && (pfd[0].revents & (POLLIN|POLLERR|POLLHUP|POLLNVAL))) {
+            char* p;
+            size_t space = ring_space(&io->rx, &p);
+            ssize_t n;
+
+            /* when rx is full, keep draining the device, and count what is lost */
+            if (space) {
+                n = read(io->fd, p, space);
+            } else {
+                n = read(io->fd, scratch, sizeof(scratch));
+            }
+
+            if (n > 0) {
+                if (space) {
+                    ring_commit(&io->rx, n);
+                } else {
+                    atomic_fetch_add(&io->rx_overruns, n);
+                }
+                atomic_fetch_add(&io->rx_bytes, n);
+                io_thread_notify(io);
+            } else if (n == 0) {
+                atomic_store(&io->eof, 1);
+                io_thread_notify(io);
+            } else if (errno != EAGAIN && errno != EINTR) {
+                atomic_store(&io->err, errno);
+                break;
+            }
+        }
+
+        if (pfd[0].revents & POLLOUT) {
+            char* p;
+            size_t used = ring_peek(&io->tx, &p);
+            ssize_t n = write(io->fd, p, used);
+
+            if (n > 0) {
+                ring_release(&io->tx, n);
+                atomic_fetch_add(&io->tx_bytes, n);
+                io_thread_space(io);
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                atomic_store(&io->err, errno);
+                break;
+            }
+        }
+    }
+
+    /* wake any waits, the reads and writes then fail with the error */
+    io_thread_notify(io);
+    io_thread_space(io);
+
+    return NULL;
+}
+
+static void io_thread_free(struct io_thread* io)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (io->wake[i] >= 0) {
+            close(io->wake[i]);
+        }
+        if (io->notify[i] >= 0) {
+            close(io->notify[i]);
+        }
+        if (io->space[i] >= 0) {
+            close(io->space[i]);
+        }
+    }
+
+    free(io->rx.data);
+    free(io->tx.data);
+    free(io);
+}
+
+/* Returns the started thread, or NULL with errno set. */
+static struct io_thread* io_thread_start(int fd, size_t rxsize, size_t txsize)
+{
+    struct io_thread* io = calloc(1, sizeof(*io));
+    int err;
+
+    if (io == NULL) {
+        return NULL;
+    }
+
+    io->fd = fd;
+    io->wake[0] = io->wake[1] = io->notify[0] = io->notify[1] = -1;
+    io->space[0] = io->space[1] = -1;
+    atomic_init(&io->stop, 0);
+    atomic_init(&io->notified, 0);
+    atomic_init(&io->spaced, 0);
+    atomic_init(&io->eof, 0);
+    atomic_init(&io->err, 0);
+    atomic_init(&io->rx_bytes, 0);
+    atomic_init(&io->tx_bytes, 0);
+    atomic_init(&io->rx_overruns, 0);
+
+    if (ring_init(&io->rx, rxsize) < 0 || ring_init(&io->tx, txsize) < 0
+            || pipe_nonblocking(io->wake) < 0 || pipe_nonblocking(io->notify) < 0
+            || pipe_nonblocking(io->space) < 0) {
+        err = errno;
+        io_thread_free(io);
+        errno = err;
+        return NULL;
+    }
+
+    /* tx starts empty */
+    io_thread_space(io);
+
+    if ((err = pthread_create(&io->thread, NULL, io_thread_run, io)) != 0) {
+        io_thread_free(io);
+        errno = err;
+        return NULL;
+    }
+
+    return io;
+}
+
+static void io_thread_wake(struct io_thread* io)
+{
+    if (write(io->wake[1], "", 1) < 0) {
+        /* a full pipe is already readable */
+    }
+}
+
+static void io_thread_stop(struct io_thread* io)
+{
+    atomic_store(&io->stop, 1);
+    io_thread_wake(io);
+    pthread_join(io->thread, NULL);
+    io_thread_free(io);
+}
+
+/* The native read and write paths go through these, so that they work the same on
+ * an fd and on a port with an io thread. For the thread, reads and writes never block,
+ * and fail with EAGAIN when the rings are empty or full. */
+static ssize_t io_read(struct io_thread* io, int fd, void* data, size_t n)
+{
+    size_t got;
+    int eof;
+    int err;
+
+    if (io == NULL) {
+        return read(fd, data, n);
+    }
+
+    /* then rx is checked, so a commit that found the flag still set is seen */
+    unsignal_pipe(&io->notified, io->notify[0]);
+
+    /* check these first, all data received before them is then in rx */
+    eof = atomic_load(&io->eof);
+    err = atomic_load(&io->err);
+
+    got = ring_get(&io->rx, data, n);
+
+    if (ring_used(&io->rx)) {
+        io_thread_notify(io);
+    }
+
+    if (got > 0) {
+        return got;
+    }
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    if (eof) {
+        return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static ssize_t io_write(struct io_thread* io, int fd, const void* data, size_t n)
+{
+    size_t put;
+    int err;
+
+    if (io == NULL) {
+        return write(fd, data, n);
+    }
+
+    if ((err = atomic_load(&io->err))) {
+        errno = err;
+        return -1;
+    }
+
+    unsignal_pipe(&io->spaced, io->space[0]);
+
+    put = ring_put(&io->tx, data, n);
+
+    if (ring_used(&io->tx) < io->tx.size) {
+        io_thread_space(io);
+    }
+
+    if (put == 0 && n > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    io_thread_wake(io);
+
+    return put;
+}
+
+/* The fd to wait on for events, which for an io thread is one of its pipes, that
+ * are waited on for POLLIN, see io_pollevents(). */
+static int io_pollfd(struct io_thread* io, int fd, short events)
+{
+    if (io == NULL) {
+        return fd;
+    }
+
+    return events == POLLIN ? io->notify[0] : io->space[0];
+}
+
+static short io_pollevents(struct io_thread* io, short events)
+{
+    return io ? POLLIN : events;
+}
+
+/* waits for fd or io with wait_fd(), as for check_wait_fd() */
+#define check_wait_io(L, io, fd, events, deadline) \
+    check_wait_fd(L, io_pollfd(io, fd, events), io_pollevents(io, events), deadline)
+
+/*-
+-- count = termios.inq(io)
+-- count = termios.outq(io)
+
+Count of bytes received and not yet read, or written and not yet
+transmitted, from the FIONREAD and TIOCOUTQ ioctls. A read of inq() bytes
+doesn't block, and outq() can be used to apply backpressure without
+waiting in termios.tcdrain().
+
+For a port with an io thread, the count includes the bytes queued between
+the thread and Lua.
+
+Returns count on success, or nil, errmsg, errno on failure.
+*/
+static int queued(lua_State* L, unsigned long request, int rx)
+{
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    int count = 0;
+
+    if (ioctl(fd, request, &count) < 0) {
+        return push_error(L);
+    }
+
+    if (io) {
+        lua_pushinteger(L, (lua_Integer) count + ring_used(rx ? &io->rx : &io->tx));
+    } else {
+        lua_pushinteger(L, count);
+    }
+
+    return 1;
+}
+
+static int ltermios_inq(lua_State *L)
+{
+    return queued(L, FIONREAD, 1);
+}
+
+static int ltermios_outq(lua_State *L)
+{
+    return queued(L, TIOCOUTQ, 0);
+}
+
+/*-
+-- fd, mode = termios.pollfd(io[, mode])
+
+The fd to wait on for io to be readable, for mode "r", or writable, for mode "w",
+and the mode to wait on the fd for. Mode defaults to "r". For a port with an io
+thread the fd is one of the thread's pipes, for data in its receive ring, or space
+in its transmit ring, and the mode to wait for it is always "r".
+*/
+static const char* wait_opts[] = { "r", "w", NULL };
+
+static int ltermios_pollfd(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+    short events = luaL_checkoption(L, 2, "r", wait_opts) ? POLLOUT : POLLIN;
+
+    struct io_thread* io = opt_io_thread(L, 1);
+
+    lua_pushinteger(L, io_pollfd(io, fd, events));
+    lua_pushstring(L, wait_opts[io_pollevents(io, events) == POLLOUT]);
+
+    return 2;
+}
+
+/*-
+-- fd = termios.waitfd(fd, mode[, timeout])
+
+Block until fd is readable, for mode "r", or writable, for mode "w". If fd is nil,
+sleep until the timeout. Timeout is in milliseconds, and nil waits forever.
+
+This is the blocking wait used by termios.co when not in a coroutine.
+
+Returns fd on success, nil, "timeout", ETIMEDOUT if the timeout expires first, or
+nil, errmsg, errno on failure.
+*/
+static int ltermios_waitfd(lua_State *L)
+{
+    int fd = lua_isnoneornil(L, 1) ? -1 : check_fileno(L, 1);
+    short events = luaL_checkoption(L, 2, "r", wait_opts) ? POLLOUT : POLLIN;
+    struct timespec deadline;
+    int timed = opt_deadline(L, 3, &deadline);
+    int ready;
+
+    if (fd < 0) {
+        if (!timed) {
+            return luaL_argerror(L, 3, "timeout required without an fd");
+        }
+
+        for (;;) {
+            struct timespec left;
+
+            clock_gettime(CLOCK_MONOTONIC, &left);
+
+            left.tv_sec = deadline.tv_sec - left.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - left.tv_nsec;
+
+            if (left.tv_nsec < 0) {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec < 0 || nanosleep(&left, NULL) == 0 || errno != EINTR) {
+                break;
+            }
+        }
+
+        return push_timeout(L);
+    }
+
+    if (timed) {
+        ready = wait_fd(fd, events, &deadline);
+    } else {
+        struct pollfd pfd;
+
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+
+        do {
+            ready = poll(&pfd, 1, -1);
+        } while (ready < 0 && errno == EINTR);
+    }
+
+    if (ready < 0) {
+        return push_error(L);
+    }
+    if (ready == 0) {
+        return push_timeout(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- drain = termios.drain(io)
+
+Start tcdrain() of io on a helper thread, and return at once. Use drain:pollfd() to
+wait for it with a poller, or drain:wait() or drain:done().
+
+The io must stay open until the drain is done.
+
+Returns drain on success, or nil, errmsg, errno on failure.
+*/
+struct drain {
+    int fd;
+    int mask; /* of modem lines for termios.modemchange(), or 0 for tcdrain() */
+    int done[2]; /* written by the thread when tcdrain() returns */
+    atomic_int refs; /* the userdata and the thread */
+    atomic_int finished;
+    atomic_int cancelled; /* the userdata was collected, or the wait timed out */
+    int err; /* errno of tcdrain(), or zero, valid once finished */
+    int bits; /* the modem bits after the change, valid once finished */
+    /* for cancelling a modem wait, see drain_cancel() */
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards running */
+    int running; /* the thread is still in modem_wait() */
+};
+
+static void drain_release(struct drain* drain)
+{
+    if (atomic_fetch_sub(&drain->refs, 1) == 1) {
+        close(drain->done[0]);
+        close(drain->done[1]);
+        pthread_mutex_destroy(&drain->lock);
+        free(drain);
+    }
+}
+
+/* Stop a modem wait's thread, if it is still waiting. */
+static void drain_cancel(struct drain* drain)
+{
+    atomic_store(&drain->cancelled, 1);
+
+#if defined(MODEM_CANCEL_SIGNAL)
+    /* the thread clears running, with the lock held, before it exits */
+    pthread_mutex_lock(&drain->lock);
+    if (drain->mask && drain->running && modem_cancel_installed) {
+        pthread_kill(drain->thread, MODEM_CANCEL_SIGNAL);
+    }
+    pthread_mutex_unlock(&drain->lock);
+#endif
+}
+
+static void* drain_run(void* arg)
+{
+    struct drain* drain = arg;
+    int ret;
+
+    if (drain->mask) {
+#if defined(MODEM_CANCEL_SIGNAL)
+        sigset_t set;
+
+        sigemptyset(&set);
+        sigaddset(&set, MODEM_CANCEL_SIGNAL);
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+#endif
+        ret = modem_wait(drain->fd, drain->mask, &drain->cancelled, &drain->bits);
+
+        pthread_mutex_lock(&drain->lock);
+        drain->running = 0;
+        pthread_mutex_unlock(&drain->lock);
+    } else {
+        do {
+            ret = tcdrain(drain->fd);
+        } while (ret < 0 && errno == EINTR);
+    }
+
+    drain->err = ret < 0 ? errno : 0;
+
+    atomic_store_explicit(&drain->finished, 1, memory_order_release);
+
+    if (write(drain->done[1], "", 1) < 0) {
+        /* the pipe is empty, this can't fail */
+    }
+
+    drain_release(drain);
+
+    return NULL;
+}
+
+static struct drain* check_drain(lua_State* L, int index)
+{
+    struct drain** drain = luaL_checkudata(L, index, DRAINID);
+
+    return *drain;
+}
+
+/* push a drain of fd, or a wait for the modem lines in mask to change */
+static int push_drain_thread(lua_State* L, int fd, int mask)
+{
+    struct drain** ud = lua_newuserdata(L, sizeof(*ud));
+    struct drain* drain;
+    pthread_attr_t attr;
+    int err;
+
+    *ud = NULL;
+
+    luaL_getmetatable(L, DRAINID);
+    lua_setmetatable(L, -2);
+
+    if ((drain = calloc(1, sizeof(*drain))) == NULL) {
+        return push_error(L);
+    }
+
+    drain->fd = fd;
+    drain->mask = mask;
+    atomic_init(&drain->refs, 2);
+    atomic_init(&drain->finished, 0);
+    atomic_init(&drain->cancelled, 0);
+    drain->running = 1;
+
+#if defined(MODEM_CANCEL_SIGNAL)
+    if (mask) {
+        pthread_once(&modem_cancel_once, modem_cancel_init);
+    }
+#endif
+
+    if (pipe_nonblocking(drain->done) < 0) {
+        err = errno;
+        free(drain);
+        errno = err;
+        return push_error(L);
+    }
+
+    pthread_mutex_init(&drain->lock, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* locked, so that thread is set before drain_cancel() can use it */
+    pthread_mutex_lock(&drain->lock);
+    err = pthread_create(&drain->thread, &attr, drain_run, drain);
+    pthread_mutex_unlock(&drain->lock);
+
+    pthread_attr_destroy(&attr);
+
+    if (err != 0) {
+        close(drain->done[0]);
+        close(drain->done[1]);
+        pthread_mutex_destroy(&drain->lock);
+        free(drain);
+        errno = err;
+        return push_error(L);
+    }
+
+    *ud = drain;
+
+    return 1;
+}
+
+static int ltermios_drain(lua_State *L)
+{
+    return push_drain_thread(L, check_fileno(L, 1), 0);
+}
+
+/*-
+-- change = termios.modemchange(io, mask)
+
+Start waiting for any of the modem lines in mask to change, as for
+termios.waitmodem(), on a helper thread, and return at once. The change has the
+methods of a termios.drain(), so use change:pollfd() to wait for it with a poller,
+or change:wait() or change:done(), which return the modem bits after the change
+instead of true.
+
+When the change is collected, the helper thread is stopped, with a signal as for
+termios.waitmodem(). If the application has its own disposition for the signal,
+the thread instead lasts until a line changes or the device hangs up.
+
+Returns change on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_modemchange(lua_State *L)
+{
+    int fd = check_fileno(L, 1);
+
+    return push_drain_thread(L, fd, check_modem(L, 2));
+}
+
+static int ldrain_gc(lua_State* L)
+{
+    struct drain** ud = luaL_checkudata(L, 1, DRAINID);
+
+    if (*ud) {
+        drain_cancel(*ud);
+        drain_release(*ud);
+        *ud = NULL;
+    }
+
+    return 0;
+}
+
+/*-
+-- fd = drain:pollfd()
+
+Return the fd that becomes readable when the drain is done.
+*/
+static int ldrain_pollfd(lua_State* L)
+{
+    lua_pushinteger(L, check_drain(L, 1)->done[0]);
+
+    return 1;
+}
+
+static int push_drain(lua_State* L, struct drain* drain)
+{
+    if (!atomic_load_explicit(&drain->finished, memory_order_acquire)) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    if (drain->err) {
+        errno = drain->err;
+        return push_error(L);
+    }
+
+    if (drain->mask) {
+        lua_pushinteger(L, drain->bits);
+    } else {
+        lua_pushboolean(L, 1);
+    }
+
+    return 1;
+}
+
+/*-
+-- done = drain:done()
+
+Returns true if the drain is done, false if it isn't, or nil, errmsg, errno if
+tcdrain() failed.
+*/
+static int ldrain_done(lua_State* L)
+{
+    return push_drain(L, check_drain(L, 1));
+}
+
+/*-
+-- done = drain:wait([timeout])
+
+Wait for the drain to be done, timeout is in milliseconds and nil waits forever.
+
+Returns true on success, nil, "timeout", ETIMEDOUT if the timeout expires first,
+or nil, errmsg, errno if tcdrain() failed.
+*/
+static int wait_drain(lua_State* L, struct drain* drain, const struct timespec* deadline)
+{
+    struct pollfd pfd;
+    int ready = 1;
+
+    if (!atomic_load_explicit(&drain->finished, memory_order_acquire)) {
+        if (deadline) {
+            ready = wait_fd(drain->done[0], POLLIN, deadline);
+        } else {
+            pfd.fd = drain->done[0];
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            do {
+                ready = poll(&pfd, 1, -1);
+            } while (ready < 0 && errno == EINTR);
+        }
+    }
+
+    if (ready < 0) {
+        return push_error(L);
+    }
+    if (ready == 0) {
+        return push_timeout(L);
+    }
+
+    return push_drain(L, drain);
+}
+
+static int ldrain_wait(lua_State* L)
+{
+    struct drain* drain = check_drain(L, 1);
+    struct timespec deadline;
+
+    return wait_drain(L, drain, opt_deadline(L, 2, &deadline) ? &deadline : NULL);
+}
+
+static int push_modem_wait(lua_State* L, int fd, int mask, const struct timespec* deadline)
+{
+    struct drain* drain;
+    int ret;
+
+    if (push_drain_thread(L, fd, mask) != 1) {
+        return 3;
+    }
+
+    drain = check_drain(L, -1);
+    ret = wait_drain(L, drain, deadline);
+
+    /* after a timeout, so the thread doesn't outlive the call */
+    drain_cancel(drain);
+
+    return ret;
+}
+
+static const luaL_reg drain_methods[] =
+{
+    {"__gc",              ldrain_gc},
+    {"pollfd",            ldrain_pollfd},
+    {"done",              ldrain_done},
+    {"wait",              ldrain_wait},
+    {NULL, NULL}
+};
+
+/*-
+-- buf = termios.buffer([size])
+
+Create a byte buffer that termios.read() can fill in place, without creating a
+string for every read. Bytes are appended at the end and taken from the start.
+
+Size is the capacity of the buffer, and defaults to LUAL_BUFFERSIZE.
+
+Returns buf on success, or nil, errmsg, errno on failure.
+*/
+struct buffer {
+    char* data;
+    size_t size;
+    size_t head; /* first byte */
+    size_t tail; /* one past the last byte */
+    /* for termios.readgap() */
+    struct timespec first; /* when the first byte was read */
+    struct timespec last; /* when the last byte was read */
+    /* for termios.setframecheck(), a CHECK_ kind, or 0 */
+    int check;
+};
+
+static struct buffer* check_buffer(lua_State* L, int index)
+{
+    struct buffer* buf = luaL_checkudata(L, index, BUFFERID);
+
+    if (buf->data == NULL)
+        luaL_error(L, "attempt to use a freed buffer");
+
+    return buf;
+}
+
+static size_t buffer_len(const struct buffer* buf)
+{
+    return buf->tail - buf->head;
+}
+
+static const char* buffer_bytes(const struct buffer* buf)
+{
+    return buf->data + buf->head;
+}
+
+/* make room for appending, returns the number of free bytes at the tail */
+static size_t buffer_compact(struct buffer* buf)
+{
+    if (buf->head == buf->tail) {
+        buf->head = buf->tail = 0;
+    } else if (buf->tail == buf->size && buf->head > 0) {
+        memmove(buf->data, buf->data + buf->head, buffer_len(buf));
+        buf->tail -= buf->head;
+        buf->head = 0;
+    }
+
+    return buf->size - buf->tail;
+}
+
+static void buffer_consume(struct buffer* buf, size_t n)
+{
+    buf->head += n;
+
+    if (buf->head == buf->tail) {
+        buf->head = buf->tail = 0;
+    }
+}
+
+/* returns 0 on success, or -1 with errno set */
+static int buffer_resize(struct buffer* buf, size_t size)
+{
+    size_t len = buffer_len(buf);
+    char* data;
+
+    if (buf->head > 0) {
+        memmove(buf->data, buf->data + buf->head, len);
+        buf->head = 0;
+        buf->tail = len;
+    }
+
+    data = realloc(buf->data, size ? size : 1);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    buf->data = data;
+    buf->size = size;
+
+    return 0;
+}
+
+/* translate a relative position the same way as string.sub() */
+static size_t check_pos(lua_State* L, int index, lua_Integer def, size_t len)
+{
+    lua_Integer pos = luaL_optinteger(L, index, def);
+
+    if (pos < 0) {
+        pos = (lua_Integer) len + pos + 1;
+    }
+    if (pos < 0) {
+        pos = 0;
+    }
+
+    return pos;
+}
+
+static int ltermios_buffer(lua_State* L)
+{
+    int size = luaL_optint(L, 1, LUAL_BUFFERSIZE);
+    struct buffer* buf;
+
+    luaL_argcheck(L, size >= 0, 1, "negative size");
+
+    buf = lua_newuserdata(L, sizeof(*buf));
+    memset(buf, 0, sizeof(*buf));
+
+    luaL_getmetatable(L, BUFFERID);
+    lua_setmetatable(L, -2);
+
+    if (buffer_resize(buf, size) < 0) {
+        return push_error(L);
+    }
+
+    return 1;
+}
+
+static int lbuffer_gc(lua_State* L)
+{
+    struct buffer* buf = luaL_checkudata(L, 1, BUFFERID);
+
+    free(buf->data);
+    buf->data = NULL;
+
+    return 0;
+}
+
+/*-
+-- len = buf:len()
+-- len = #buf
+
+Return the number of bytes in the buffer.
+*/
+static int lbuffer_len(lua_State* L)
+{
+    lua_pushinteger(L, buffer_len(check_buffer(L, 1)));
+
+    return 1;
+}
+
+/*-
+-- size = buf:size()
+
+Return the capacity of the buffer.
+*/
+static int lbuffer_size(lua_State* L)
+{
+    lua_pushinteger(L, check_buffer(L, 1)->size);
+
+    return 1;
+}
+
+/*-
+-- buf = buf:resize(size)
+
+Change the capacity of the buffer. Size can't be less than buf:len().
+
+Returns buf on success, or nil, errmsg, errno on failure.
+*/
+static int lbuffer_resize(lua_State* L)
+{
+    struct buffer* buf = check_buffer(L, 1);
+    int size = luaL_checkint(L, 2);
+
+    luaL_argcheck(L, size >= 0 && (size_t) size >= buffer_len(buf), 2, "smaller than buffer length");
+
+    if (buffer_resize(buf, size) < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- buf = buf:clear()
+
+Discard all bytes in the buffer.
+*/
+static int lbuffer_clear(lua_State* L)
+{
+    struct buffer* buf = check_buffer(L, 1);
+
+    buf->head = buf->tail = 0;
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- data = buf:peek([i[, j]])
+
+Return bytes i to j of the buffer as a string, without removing them. Positions
+are as for string.sub(), and default to the whole buffer.
+*/
+static int lbuffer_peek(lua_State* L)
+{
+    struct buffer* buf = check_buffer(L, 1);
+    size_t len = buffer_len(buf);
+    size_t i = check_pos(L, 2, 1, len);
+    size_t j = check_pos(L, 3, -1, len);
+
+    if (i < 1) {
+        i = 1;
+    }
+    if (j > len) {
+        j = len;
+    }
+
+    if (i > j) {
+        lua_pushliteral(L, "");
+    } else {
+        lua_pushlstring(L, buffer_bytes(buf) + i - 1, j - i + 1);
+    }
+
+    return 1;
+}
+
+/*-
+-- byte = buf:byte(i)
+
+Return the numeric value of the byte at position i, or nil if i is out of range.
+*/
+static int lbuffer_byte(lua_State* L)
+{
+    struct buffer* buf = check_buffer(L, 1);
+    size_t len = buffer_len(buf);
+    size_t i = check_pos(L, 2, 1, len);
+
+    if (i < 1 || i > len) {
+        return 0;
+    }
+
+    lua_pushinteger(L, (unsigned char) buffer_bytes(buf)[i - 1]);
+
+    return 1;
+}
+
+static const char* find_bytes(const char* s, size_t len, const char* delim, size_t dlen)
+{
+    const char* end = s + len;
+
+    if (dlen == 0) {
+        return s;
+    }
+
+    while ((size_t) (end - s) >= dlen) {
+        s = memchr(s, delim[0], (end - s) - dlen + 1);
+
+        if (s == NULL) {
+            return NULL;
+        }
+        if (memcmp(s, delim, dlen) == 0) {
+            return s;
+        }
+        s++;
+    }
+
+    return NULL;
+}
+
+/*-
+-- i, j = buf:find(delim[, init])
+
+Find the first occurrence of the string delim in the buffer, starting at position
+init, which defaults to 1. The delimiter is a plain string, not a pattern.
+
+Returns the positions of the first and last bytes of delim, or nil if not found.
+*/
+static int lbuffer_find(lua_State* L)
+{
+    struct buffer* buf = check_buffer(L, 1);
+    size_t dlen = 0;
+    const char* delim = luaL_checklstring(L, 2, &dlen);
+    size_t len = buffer_len(buf);
+    size_t init = check_pos(L, 3, 1, len);
+    const char* found;
+
+    if (init < 1) {
+        init = 1;
+    }
+    if (init > len + 1) {
+        return 0;
+    }
+
+    found = find_bytes(buffer_bytes(buf) + init - 1, len - (init - 1), delim, dlen);
+
+    if (found == NULL) {
+        return 0;
+    }
+
+    lua_pushinteger(L, found - buffer_bytes(buf) + 1);
+    lua_pushinteger(L, found - buffer_bytes(buf) + dlen);
+
+    return 2;
+}
+
+/*-
+-- data = buf:take(n)
+
+Remove the first n bytes from the buffer, and return them as a string. If the
+buffer holds fewer than n bytes, all of them are returned.
+*/
+static int lbuffer_take(lua_State* L)
+{
+    struct buffer* buf = check_buffer(L, 1);
+    int n = luaL_checkint(L, 2);
+    size_t len = buffer_len(buf);
+
+    luaL_argcheck(L, n >= 0, 2, "negative size");
+
+    if ((size_t) n > len) {
+        n = len;
+    }
+
+    lua_pushlstring(L, buffer_bytes(buf), n);
+
+    buffer_consume(buf, n);
+
+    return 1;
+}
+
+/*-
+-- buf = buf:discard(n)
+
+Remove the first n bytes from the buffer.
+*/
+static int lbuffer_discard(lua_State* L)
+{
+    struct buffer* buf = check_buffer(L, 1);
+    int n = luaL_checkint(L, 2);
+    size_t len = buffer_len(buf);
+
+    luaL_argcheck(L, n >= 0, 2, "negative size");
+
+    buffer_consume(buf, (size_t) n > len ? len : (size_t) n);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static const luaL_reg buffer_methods[] =
+{
+    {"__gc",              lbuffer_gc},
+    {"__len",             lbuffer_len},
+    {"len",               lbuffer_len},
+    {"size",              lbuffer_size},
+    {"resize",            lbuffer_resize},
+    {"clear",             lbuffer_clear},
+    {"peek",              lbuffer_peek},
+    {"byte",              lbuffer_byte},
+    {"find",              lbuffer_find},
+    {"take",              lbuffer_take},
+    {"discard",           lbuffer_discard},
+    {NULL, NULL}
+};
+
+static int readbuffer(lua_State* L, int fd, struct io_thread* io, struct buffer* buf, const struct timespec* deadline)
+{
+    size_t space = buffer_compact(buf);
+    ssize_t n;
+
+    if (space == 0) {
+        return push_failure(L, ENOBUFS, "buffer full");
+    }
+
+    check_wait_io(L, io, fd, POLLIN, deadline);
+
+    n = io_read(io, fd, buf->data + buf->tail, space);
+
+    if (n < 0) {
+        return push_error(L);
+    }
+
+    buf->tail += n;
+
+    lua_pushinteger(L, n);
+
+    return 1;
+}
+
+/*-
+-- data = termios.read(io, size[, timeout])
+-- count = termios.read(io, buf[, timeout])
+
+Read up to size bytes from io with read(), directly on the file descriptor, so
+without the buffering of the standard io library.
+
+If a buffer is passed instead of a size, data is appended to the buffer, up to its
+free space, and the number of bytes read is returned instead of the data. If the
+buffer is full, the read fails with ENOBUFS.
+
+If timeout, in milliseconds, is given, wait with poll() for up to that long for io
+to be readable, and return as soon as any data is available. If none is, the read
+fails with ETIMEDOUT, and errmsg is "timeout".
+
+Returns the data read on success, which is an empty string at end of file, or nil,
+errmsg, errno on failure. A non-blocking io with no data available fails with
+EAGAIN.
+*/
+static int ltermios_read(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    struct timespec deadline;
+    const struct timespec* timeout = opt_deadline(L, 3, &deadline) ? &deadline : NULL;
+    int size;
+    char buf[LUAL_BUFFERSIZE];
+    char* p = buf;
+    ssize_t n;
+
+    if (lua_isuserdata(L, 2)) {
+        return readbuffer(L, fd, io, check_buffer(L, 2), timeout);
+    }
+
+    size = luaL_checkint(L, 2);
+
+    luaL_argcheck(L, size >= 0, 2, "negative size");
+
+    /* the userdata is garbage, but is collected even if the read fails */
+    if (size > (int) sizeof(buf)) {
+        p = lua_newuserdata(L, size);
+    }
+
+    check_wait_io(L, io, fd, POLLIN, timeout);
+
+    n = io_read(io, fd, p, size);
+
+    if (n < 0) {
+        return push_error(L);
+    }
+
+    lua_pushlstring(L, p, n);
+
+    return 1;
+}
+
+/*-
+-- written = termios.write(io, data[, offset[, length[, timeout]]])
+
+Write length bytes of data to io with write(), starting with the byte at offset,
+directly on the file descriptor, so without the buffering of the standard io
+library.
+
+Offset is the position of the first byte to write, defaulting to 1, and length
+defaults to the rest of data. For a non-blocking io the write can be partial, and
+the remainder can be written without copying it by passing offset + written.
+
+If timeout, in milliseconds, is given, wait with poll() for up to that long for io
+to be writable, see termios.read().
+
+Returns the number of bytes written on success, or nil, errmsg, errno on failure.
+*/
+static int ltermios_write(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    size_t len = 0;
+    const char* data = luaL_checklstring(L, 2, &len);
+    int offset = luaL_optint(L, 3, 1);
+    struct timespec deadline;
+    const struct timespec* timeout = opt_deadline(L, 5, &deadline) ? &deadline : NULL;
+    int size;
+    ssize_t n;
+
+    luaL_argcheck(L, offset >= 1 && (size_t) offset <= len + 1, 3, "out of range");
+
+    size = luaL_optint(L, 4, len - (offset - 1));
+
+    luaL_argcheck(L, size >= 0 && (size_t) size <= len - (offset - 1), 4, "out of range");
+
+    check_wait_io(L, io, fd, POLLOUT, timeout);
+
+    n = io_write(io, fd, data + offset - 1, size);
+
+    if (n < 0) {
+        return push_error(L);
+    }
+
+    lua_pushinteger(L, n);
+
+    return 1;
+}
+
+/*-
+-- written = termios.writev(io, s1, s2, ...)
+-- written = termios.writev(io, strings[, skip[, timeout]])
+
+Write the strings to io with a single writev(), directly from the strings, so
+without concatenating them first. Strings is an array of the strings.
+
+For a non-blocking io the write can be partial, and the remainder can be written by
+passing the same strings, with skip as the total number of bytes written so far,
+which defaults to zero. At most IOV_MAX strings are written by a single call, the
+rest are left for the next.
+
+If timeout, in milliseconds, is given, wait with poll() for up to that long for io
+to be writable, see termios.read().
+
+Returns the number of bytes written on success, or nil, errmsg, errno on failure.
+*/
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/* returns the result of writev(), with errno set on failure */
+static ssize_t write_iov(struct io_thread* io, int fd, const struct iovec* iov, int iovcnt)
+{
+    ssize_t n;
+    int i;
+
+    if (!io) {
+        return writev(fd, iov, iovcnt);
+    }
+
+    /* the rings are in memory, so there is nothing to gain from gathering */
+    n = 0;
+    for (i = 0; i < iovcnt; i++) {
+        ssize_t put = io_write(io, fd, iov[i].iov_base, iov[i].iov_len);
+
+        if (put < 0) {
+            if (n > 0) {
+                break;
+            }
+            return -1;
+        }
+        n += put;
+        if ((size_t) put < iov[i].iov_len) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+static int ltermios_writev(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    int table = lua_istable(L, 2);
+    int count = table ? (int) lua_objlen(L, 2) : lua_gettop(L) - 1;
+    lua_Number skip = table ? luaL_optnumber(L, 3, 0) : 0;
+    struct timespec deadline;
+    const struct timespec* timeout = table && opt_deadline(L, 4, &deadline) ? &deadline : NULL;
+    struct iovec local[32];
+    struct iovec* iov = local;
+    int iovmax = count < IOV_MAX ? count : IOV_MAX;
+    int iovcnt = 0;
+    ssize_t n;
+    int i;
+
+    luaL_argcheck(L, skip >= 0, 3, "negative skip");
+
+    if (iovmax > (int) (sizeof(local)/sizeof(local[0]))) {
+        iov = lua_newuserdata(L, iovmax * sizeof(*iov));
+    }
+
+    /* the cap is on the strings written, not those skipped, so a write resumes */
+    for (i = 0; i < count && iovcnt < iovmax; i++) {
+        size_t len = 0;
+        const char* s;
+
+        if (table) {
+            lua_rawgeti(L, 2, i + 1);
+            /* no conversion from numbers, the string must stay referenced by strings once popped */
+            s = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &len) : NULL;
+            lua_pop(L, 1);
+            if (s == NULL) {
+                return luaL_argerror(L, 2, lua_pushfstring(L, "string expected at index %d", i + 1));
+            }
+        } else {
+            s = luaL_checklstring(L, i + 2, &len);
+        }
+
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+
+        iov[iovcnt].iov_base = (char*) s + (size_t) skip;
+        iov[iovcnt].iov_len = len - (size_t) skip;
+        iovcnt++;
+        skip = 0;
+    }
+
+    if (iovcnt == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    check_wait_io(L, io, fd, POLLOUT, timeout);
+
+    n = write_iov(io, fd, iov, iovcnt);
+
+    if (n < 0) {
+        return push_error(L);
+    }
+
+    lua_pushinteger(L, n);
+
+    return 1;
+}
+
+/*-
+-- sent = termios.sendfile(io, file[, offset[, length[, chunk[, pace]]]])
+
+Stream length bytes of a file, starting at offset, to io, without reading the file
+into Lua. File is a path, or an fd number or io object open for reading.
+
+Offset defaults to zero, and length to the rest of the file. The file is written in
+writes of at most chunk bytes, default 4096, and if pace is given, it is the
+microseconds to sleep between chunks, to keep from overflowing a device's receive
+buffer.
+
+On Linux, sendfile() is used if the kernel supports it for io, otherwise the file is
+memory-mapped, and written from the mapping. A non-blocking io is waited for with
+poll() when it is not writable, so the whole range is always sent.
+
+Returns the number of bytes sent on success, which is less than length only if the
+file was shorter, or nil, errmsg, errno, sent on failure.
+*/
+static int wait_writable(struct io_thread* io, int fd)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = io_pollfd(io, fd, POLLOUT);
+    pfd.events = io_pollevents(io, POLLOUT);
+    pfd.revents = 0;
+
+    do {
+        n = poll(&pfd, 1, -1);
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+}
+
+static void pace_sleep(long us)
+{
+    struct timespec ts;
+
+    if (us <= 0) {
+        return;
+    }
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* Returns 0 on success, or -1 with errno set, and sent is the bytes sent in either case. */
+static int stream_file(int fd, struct io_thread* io, int in, off_t offset, size_t len,
+        size_t chunk, long pace, size_t* sent)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t window;
+
+    if (len == 0) {
+        return 0;
+    }
+
+#if defined(__linux__)
+    /* the io thread owns writes to the fd */
+    while (io == NULL && *sent < len) {
+        size_t n = len - *sent < chunk ? len - *sent : chunk;
+        ssize_t w = sendfile(fd, in, &offset, n);
+
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                if (wait_writable(io, fd) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            /* not supported for these fds, so fall back to the mapping */
+            if ((errno == EINVAL || errno == ENOSYS) && *sent == 0) {
+                break;
+            }
+            return -1;
+        }
+
+        if (w == 0) {
+            /* the file is shorter than len */
+            return 0;
+        }
+
+        *sent += w;
+
+        if (*sent < len) {
+            pace_sleep(pace);
+        }
+    }
+
+    if (*sent > 0) {
+        return 0;
+    }
+#endif
+
+    /* mapped a window of chunk bytes, rounded up to pages, at a time, so the address
+     * space used doesn't grow with the file */
+    window = (chunk + page - 1) / page * page;
+
+    while (*sent < len) {
+        off_t pos = offset + (off_t) *sent;
+        off_t base = pos - pos % page;
+        size_t skew = pos - base;
+        size_t avail = len - *sent < window ? len - *sent : window;
+        char* map = mmap(NULL, avail + skew, PROT_READ, MAP_SHARED, in, base);
+        size_t done = 0;
+        int err;
+
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+
+        while (done < avail) {
+            size_t n = avail - done < chunk ? avail - done : chunk;
+            ssize_t w = io_write(io, fd, map + skew + done, n);
+
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN && wait_writable(io, fd) >= 0) {
+                    continue;
+                }
+                break;
+            }
+
+            done += w;
+            *sent += w;
+
+            if (*sent < len) {
+                pace_sleep(pace);
+            }
+        }
+
+        err = errno;
+        munmap(map, avail + skew);
+
+        if (done < avail) {
+            errno = err;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int ltermios_sendfile(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    const char* path = lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : NULL;
+    int in = path ? -1 : check_fileno(L, 2);
+    lua_Number offset = luaL_optnumber(L, 3, 0);
+    lua_Number length = luaL_optnumber(L, 4, -1);
+    int chunk = luaL_optint(L, 5, 4096);
+    int pace = luaL_optint(L, 6, 0);
+    struct stat st;
+    size_t sent = 0;
+    int ret;
+
+    luaL_argcheck(L, offset >= 0, 3, "negative offset");
+    luaL_argcheck(L, chunk > 0, 5, "must be positive");
+    luaL_argcheck(L, pace >= 0, 6, "negative pace");
+
+    if (path && (in = open(path, O_RDONLY)) < 0) {
+        return push_error(L);
+    }
+
+    if (fstat(in, &st) < 0) {
+        ret = -1;
+    } else {
+        lua_Number rest = (lua_Number) st.st_size - offset;
+
+        if (rest < 0) {
+            rest = 0;
+        }
+        if (length < 0 || length > rest) {
+            length = rest;
+        }
+
+        ret = stream_file(fd, io, in, (off_t) offset, (size_t) length, chunk, pace, &sent);
+    }
+
+    if (path) {
+        int err = errno;
+        close(in);
+        errno = err;
+    }
+
+    if (ret < 0) {
+        push_error(L);
+        lua_pushinteger(L, sent);
+        return 4;
+    }
+
+    lua_pushinteger(L, sent);
+
+    return 1;
+}
+
+/*-
+-- sum = termios.checksum(kind, data[, init])
+
+Compute a checksum of data, a string or a termios.buffer(), in C. Kind is one of:
+
+- "crc16": the CRC-16 of Modbus RTU, polynomial 0x8005 reflected, initially 0xFFFF
+- "crc32": the CRC-32 of Ethernet and zlib, polynomial 0x04C11DB7 reflected
+- "crc32c": the CRC-32C of iSCSI and SCTP, polynomial 0x1EDC6F41 reflected
+- "lrc": a raw one-byte LRC, the two's complement of the sum of the bytes, as
+  computed by Modbus ASCII over the decoded frame, though that sends it as two hex
+  digits, with the rest of the frame, so framing Modbus ASCII is left to Lua
+- "xor": the exclusive or of the bytes
+
+The CRCs are computed by slicing-by-8 tables, or by the CRC32 instructions of the
+cpu where there are any, SSE4.2 for CRC-32C on x86-64, and the CRC extension of
+ARMv8 for both CRC-32s.
+
+Init is a previous sum, to continue it over more data, so that the sum of a frame
+can be computed in parts. It defaults to the initial value of the kind.
+
+Returns the sum as an integer.
+*/
+#define CHECK_CRC16  1
+#define CHECK_CRC32  2
+#define CHECK_CRC32C 3
+#define CHECK_LRC    4
+#define CHECK_XOR    5
+
+static const char* checks[] = { "crc16", "crc32", "crc32c", "lrc", "xor", NULL };
+
+/* the number of bytes a checksum of each kind is sent as */
+static const int check_sizes[] = { 0, 2, 4, 4, 1, 1 };
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_SSE42
+static int crc32c_sse42;
+#endif
+
+static uint32_t crc_tables[3][8][256]; /* crc16, crc32, crc32c */
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    static const uint32_t polys[] = { 0xA001, 0xEDB88320, 0x82F63B78 };
+    int t, i, k;
+
+    for (t = 0; t < 3; t++) {
+        for (i = 0; i < 256; i++) {
+            uint32_t c = i;
+
+            for (k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ polys[t] : c >> 1;
+            }
+            crc_tables[t][0][i] = c;
+        }
+        /* table k is the crc of a byte followed by k zero bytes */
+        for (k = 1; k < 8; k++) {
+            for (i = 0; i < 256; i++) {
+                uint32_t c = crc_tables[t][k - 1][i];
+
+                crc_tables[t][k][i] = (c >> 8) ^ crc_tables[t][0][c & 0xff];
+            }
+        }
+    }
+
+#if defined(CRC32C_SSE42)
+    __builtin_cpu_init();
+    crc32c_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* a reflected crc of up to 32 bits, without the initial or final inversion */
+static uint32_t crc_slice8(uint32_t (*t)[256], uint32_t crc, const unsigned char* p, size_t n)
+{
+    while (n >= 8) {
+        uint32_t a = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        uint32_t b = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+
+        crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24]
+            ^ t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+        p += 8;
+        n -= 8;
+    }
+
+    while (n--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+
+    return crc;
+}
+
+#if defined(CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n)
+{
+    uint64_t c = crc;
+
+    while (n >= 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        n -= 8;
+    }
+
+    crc = (uint32_t) c;
+
+    while (n--) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+
+    return crc;
+}
+#endif
+
+#if defined(__ARM_FEATURE_CRC32) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_ARM
+/* the same for both, with the crc32 or crc32c instructions */
+#define CRC_ARM(name, op64, op8) \
+static uint32_t name(uint32_t crc, const unsigned char* p, size_t n) \
+{ \
+    while (n >= 8) { \
+        uint64_t v; \
+        memcpy(&v, p, 8); \
+        crc = op64(crc, v); \
+        p += 8; \
+        n -= 8; \
+    } \
+    while (n--) { \
+        crc = op8(crc, *p++); \
+    } \
+    return crc; \
+}
+
+CRC_ARM(crc32_arm, __crc32d, __crc32b)
+CRC_ARM(crc32c_arm, __crc32cd, __crc32cb)
+#endif
+
+static uint32_t checksum(int kind, uint32_t init, const void* data, size_t n)
+{
+    const unsigned char* p = data;
+    unsigned char sum = 0;
+
+    pthread_once(&crc_once, crc_init);
+
+    switch (kind) {
+        case CHECK_CRC16:
+            return crc_slice8(crc_tables[0], init & 0xffff, p, n);
+        case CHECK_CRC32:
+#if defined(CRC32_ARM)
+            return ~crc32_arm(~init, p, n);
+#else
+            return ~crc_slice8(crc_tables[1], ~init, p, n);
+#endif
+        case CHECK_CRC32C:
+#if defined(CRC32_ARM)
+            return ~crc32c_arm(~init, p, n);
+#else
+#if defined(CRC32C_SSE42)
+            if (crc32c_sse42) {
+                return ~crc32c_hw(~init, p, n);
+            }
+#endif
+            return ~crc_slice8(crc_tables[2], ~init, p, n);
+#endif
+        case CHECK_LRC:
+            /* undo the negation of init to continue the sum */
+            sum = (unsigned char) (0 - init);
+            while (n--) {
+                sum += *p++;
+            }
+            return (unsigned char) (0 - sum);
+        case CHECK_XOR:
+            sum = (unsigned char) init;
+            while (n--) {
+                sum ^= *p++;
+            }
+            return sum;
+    }
+
+    return 0;
+}
+
+/* the initial sum of a kind */
+static uint32_t checksum_init(int kind)
+{
+    return kind == CHECK_CRC16 ? 0xffff : 0;
+}
+
+/* Store sum as the check_sizes[kind] bytes it is sent as, least significant first. */
+static void checksum_bytes(int kind, uint32_t sum, unsigned char* bytes)
+{
+    int i;
+
+    for (i = 0; i < check_sizes[kind]; i++) {
+        bytes[i] = (unsigned char) (sum >> (8 * i));
+    }
+}
+
+static int check_checksum(lua_State* L, int index)
+{
+    return luaL_checkoption(L, index, NULL, checks) + 1;
+}
+
+/* data is a string or a buffer */
+static const char* check_data(lua_State* L, int index, size_t* len)
+{
+    if (lua_isuserdata(L, index)) {
+        struct buffer* buf = check_buffer(L, index);
+
+        *len = buffer_len(buf);
+        return buffer_bytes(buf);
+    }
+
+    return luaL_checklstring(L, index, len);
+}
+
+static int ltermios_checksum(lua_State* L)
+{
+    int kind = check_checksum(L, 1);
+    size_t len = 0;
+    const char* data = check_data(L, 2, &len);
+    uint32_t init = (uint32_t) luaL_optinteger(L, 3, checksum_init(kind));
+
+    lua_pushinteger(L, checksum(kind, init, data, len));
+
+    return 1;
+}
+
+/*-
+-- written = termios.writecrc(io, data, kind[, skip[, timeout]])
+
+Write data, a string or a termios.buffer(), followed by its checksum, see
+termios.checksum(), with a single writev(), so without copying data, or touching it
+from Lua. The checksum is written least significant byte first, as Modbus RTU and
+Ethernet send them, and the LRC and XOR are a single raw byte, not hex digits.
+
+For a non-blocking io the write can be partial, and the remainder can be written by
+passing skip as the number of bytes written so far, see termios.writev(). The bytes
+of a buffer aren't consumed, so it must not change until the whole frame is written.
+
+If timeout, in milliseconds, is given, wait with poll() for up to that long for io
+to be writable, see termios.read().
+
+Returns the number of bytes written, of data and checksum, on success, or nil,
+errmsg, errno on failure.
+*/
+static int ltermios_writecrc(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    size_t len = 0;
+    const char* data = check_data(L, 2, &len);
+    int kind = check_checksum(L, 3);
+    lua_Number skip = luaL_optnumber(L, 4, 0);
+    struct timespec deadline;
+    const struct timespec* timeout = opt_deadline(L, 5, &deadline) ? &deadline : NULL;
+    unsigned char sum[4];
+    size_t size = check_sizes[kind];
+    struct iovec iov[2];
+    int iovcnt = 0;
+    ssize_t n;
+
+    luaL_argcheck(L, skip >= 0, 4, "negative skip");
+
+    checksum_bytes(kind, checksum(kind, checksum_init(kind), data, len), sum);
+
+    if (skip < len) {
+        iov[iovcnt].iov_base = (char*) data + (size_t) skip;
+        iov[iovcnt].iov_len = len - (size_t) skip;
+        iovcnt++;
+        skip = 0;
+    } else {
+        skip -= len;
+    }
+
+    if (skip < size) {
+        iov[iovcnt].iov_base = sum + (size_t) skip;
+        iov[iovcnt].iov_len = size - (size_t) skip;
+        iovcnt++;
+    }
+
+    if (iovcnt == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    check_wait_io(L, io, fd, POLLOUT, timeout);
+
+    n = write_iov(io, fd, iov, iovcnt);
+
+    if (n < 0) {
+        return push_error(L);
+    }
+
+    lua_pushinteger(L, n);
+
+    return 1;
+}
+
+/*-
+-- buf = termios.framebuffer(io)
+
+Return the buffer that termios.readuntil() and termios.readprefixed() keep for io,
+holding the bytes read past the end of the last frame. It is created if necessary,
+and is forgotten by termios.close().
+*/
+#define FRAME_MAX 65536
+
+static struct buffer* frame_buffer(lua_State* L, int fd)
+{
+    struct buffer* buf;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, FRAMESID);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, FRAMESID);
+    }
+
+    lua_rawgeti(L, -1, fd);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushcfunction(L, ltermios_buffer);
+        lua_call(L, 0, 3);
+        if (lua_isnil(L, -3)) {
+            luaL_error(L, "%s", lua_tostring(L, -2));
+        }
+        lua_pop(L, 2);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, fd);
+    }
+
+    /* referenced from the registry, so safe to pop */
+    buf = check_buffer(L, -1);
+
+    lua_pop(L, 2);
+
+    return buf;
+}
+
+static int ltermios_framebuffer(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+
+    frame_buffer(L, fd);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, FRAMESID);
+    lua_rawgeti(L, -1, fd);
+
+    return 1;
+}
+
+/*-
+-- io = termios.setframecheck(io, kind)
+
+Verify the checksum at the end of each frame returned by termios.readuntil(),
+termios.readprefixed(), and termios.readgap() for io, in the same call that reads the
+frame, and strip it from the frame. Kind is as for termios.checksum(), with the
+checksum sent as by termios.writecrc(), or nil to stop verifying.
+
+A frame with the wrong checksum, or too short to have one, is discarded, and the
+read fails with EBADMSG, and errmsg "checksum mismatch". Like the frame buffer, the
+kind is forgotten by termios.close().
+
+Returns io.
+*/
+static int ltermios_setframecheck(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    int kind = lua_isnoneornil(L, 2) ? 0 : check_checksum(L, 2);
+
+    frame_buffer(L, fd)->check = kind;
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/* Push the frame, or if it fails the frame check of buf, nil, errmsg, errno. */
+static int push_checked_frame(lua_State* L, const struct buffer* buf, const char* frame, size_t len)
+{
+    unsigned char sum[4];
+    size_t size;
+
+    if (!buf->check) {
+        lua_pushlstring(L, frame, len);
+        return 1;
+    }
+
+    size = check_sizes[buf->check];
+
+    if (len >= size) {
+        len -= size;
+        checksum_bytes(buf->check, checksum(buf->check, checksum_init(buf->check), frame, len), sum);
+        if (memcmp(frame + len, sum, size) == 0) {
+            lua_pushlstring(L, frame, len);
+            return 1;
+        }
+    }
+
+    return push_failure(L, EBADMSG, "checksum mismatch");
+}
+
+/* Read once into buf, at most most bytes, after making room for at least want bytes
+ * in total. Returns the result of read(), with errno set on failure. */
+static ssize_t buffer_fill_most(struct io_thread* io, int fd, struct buffer* buf,
+        size_t want, size_t most)
+{
+    size_t space = buffer_compact(buf);
+    ssize_t n;
+
+    if (buffer_len(buf) + space < want || space == 0) {
+        size_t size = buf->size ? buf->size : LUAL_BUFFERSIZE;
+
+        while (size < want || size == buffer_len(buf)) {
+            size *= 2;
+        }
+        if (buffer_resize(buf, size) < 0) {
+            return -1;
+        }
+        space = buf->size - buf->tail;
+    }
+
+    if (space > most) {
+        space = most;
+    }
+
+    n = io_read(io, fd, buf->data + buf->tail, space);
+
+    if (n > 0) {
+        buf->tail += n;
+    }
+
+    return n;
+}
+
+static ssize_t buffer_fill(struct io_thread* io, int fd, struct buffer* buf, size_t want)
+{
+    return buffer_fill_most(io, fd, buf, want, SIZE_MAX);
+}
+
+static int push_frame_too_long(lua_State* L)
+{
+    return push_failure(L, EMSGSIZE, "frame too long");
+}
+
+/*-
+-- frame = termios.readuntil(io, delim[, max[, timeout]])
+
+Read from io until the string delim is found, and return the bytes before it. The
+delimiter is searched for in C, and bytes after the delimiter are kept for the next
+frame, see termios.framebuffer().
+
+Max is the most bytes to buffer while searching for the delimiter, including it,
+and defaults to 65536. If it is reached, the read fails with EMSGSIZE, and the bytes
+stay buffered.
+
+At end of file, any bytes without a delimiter are returned as the last frame, after
+which nil is returned.
+
+If timeout, in milliseconds, is given, it is the longest to wait for the whole
+frame, see termios.read(). A partial frame stays buffered if the read times out.
+
+Returns the frame on success, or nil, errmsg, errno on failure. A non-blocking io
+fails with EAGAIN when no complete frame is available, keeping any partial frame.
+*/
+static int ltermios_readuntil(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    size_t dlen = 0;
+    const char* delim = luaL_checklstring(L, 2, &dlen);
+    int max = luaL_optint(L, 3, FRAME_MAX);
+    struct timespec deadline;
+    const struct timespec* timeout = opt_deadline(L, 4, &deadline) ? &deadline : NULL;
+    struct buffer* buf = frame_buffer(L, fd);
+    size_t scanned = 0;
+
+    luaL_argcheck(L, dlen > 0, 2, "empty delimiter");
+    luaL_argcheck(L, max > 0, 3, "must be positive");
+
+    for (;;) {
+        size_t len = buffer_len(buf);
+        const char* found;
+        ssize_t n;
+
+        /* only search bytes that weren't searched already */
+        found = find_bytes(buffer_bytes(buf) + scanned, len - scanned, delim, dlen);
+
+        if (found) {
+            size_t flen = found - buffer_bytes(buf);
+            int ret = push_checked_frame(L, buf, buffer_bytes(buf), flen);
+
+            buffer_consume(buf, flen + dlen);
+            return ret;
+        }
+
+        scanned = len < dlen ? 0 : len - dlen + 1;
+
+        if (len >= (size_t) max) {
+            return push_frame_too_long(L);
+        }
+
+        check_wait_io(L, io, fd, POLLIN, timeout);
+
+        n = buffer_fill(io, fd, buf, len + 1);
+
+        if (n < 0) {
+            return push_error(L);
+        }
+
+        if (n == 0) {
+            int ret;
+
+            if (buffer_len(buf) == 0) {
+                return 0;
+            }
+            ret = push_checked_frame(L, buf, buffer_bytes(buf), buffer_len(buf));
+            buffer_consume(buf, buffer_len(buf));
+            return ret;
+        }
+
+        /* scanned is relative to the head, so compaction doesn't invalidate it */
+    }
+}
+
+/*-
+-- frame = termios.readprefixed(io, size[, order[, max[, timeout]]])
+
+Read a frame from io that is prefixed by its length, and return the frame without
+the prefix. Bytes after the frame are kept for the next frame, see
+termios.framebuffer().
+
+Size is the size of the length prefix in bytes, 1, 2, or 4. Order is the byte order
+of the prefix, "big" or "little", and defaults to "big".
+
+Max is the largest frame length accepted, and defaults to 65536. A longer frame
+fails with EMSGSIZE, and its bytes stay buffered.
+
+If timeout, in milliseconds, is given, it is the longest to wait for the whole
+frame, see termios.readuntil().
+
+Returns the frame on success, or nil, errmsg, errno on failure. A partial frame at
+end of file is discarded, and nil is returned. A non-blocking io fails with EAGAIN
+when no complete frame is available, keeping any partial frame.
+*/
+static int ltermios_readprefixed(lua_State* L)
+{
+    static const char* opts[] = { "big", "little", NULL };
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    int size = luaL_checkint(L, 2);
+    int little = luaL_checkoption(L, 3, "big", opts);
+    int max = luaL_optint(L, 4, FRAME_MAX);
+    struct timespec deadline;
+    const struct timespec* timeout = opt_deadline(L, 5, &deadline) ? &deadline : NULL;
+    struct buffer* buf = frame_buffer(L, fd);
+
+    luaL_argcheck(L, size == 1 || size == 2 || size == 4, 2, "must be 1, 2, or 4");
+    luaL_argcheck(L, max >= 0, 4, "negative size");
+
+    for (;;) {
+        size_t len = buffer_len(buf);
+        size_t want = size;
+        ssize_t n;
+
+        if (len >= (size_t) size) {
+            const unsigned char* p = (const unsigned char*) buffer_bytes(buf);
+            unsigned long flen = 0;
+            int i;
+
+            for (i = 0; i < size; i++) {
+                flen = (flen << 8) | p[little ? size - 1 - i : i];
+            }
+
+            if (flen > (unsigned long) max) {
+                return push_frame_too_long(L);
+            }
+
+            want = size + flen;
+
+            if (len >= want) {
+                int ret = push_checked_frame(L, buf, buffer_bytes(buf) + size, flen);
+
+                buffer_consume(buf, want);
+                return ret;
+            }
+        }
+
+        check_wait_io(L, io, fd, POLLIN, timeout);
+
+        n = buffer_fill(io, fd, buf, want);
+
+        if (n < 0) {
+            return push_error(L);
+        }
+
+        if (n == 0) {
+            buffer_consume(buf, buffer_len(buf));
+            return 0;
+        }
+    }
+}
+
+/*-
+-- frame, first, last = termios.readgap(io, gap[, max[, timeout]])
+
+Read a frame from io that ends when no bytes are received for gap milliseconds, as
+for the inter-frame gap of Modbus RTU, with the framing done in C. Bytes after a gap
+are kept for the next frame, see termios.framebuffer().
+
+Each read() is timestamped on the monotonic clock as soon as it returns, and first
+and last are the timestamps of the reads of the first and last bytes of the frame,
+in seconds, comparable with termios.monotonic(). Bytes from a single read() are
+never split into different frames, so reads should be frequent enough, such as with
+a VMIN of 1 and raw mode, to find gaps between them. A port with an io thread is an
+error, as the bytes are only seen once they are in its receive ring, which can
+hold several frames.
+
+Max is the most bytes in a frame, and defaults to 65536. No read goes past it, and
+if more bytes follow without a gap, the read fails with EMSGSIZE, and the bytes stay
+buffered.
+
+At end of file, any buffered bytes are returned as the last frame, after which nil
+is returned.
+
+If timeout, in milliseconds, is given, it is the longest to wait for the whole
+frame, see termios.readuntil(). A partial frame stays buffered if the read times out.
+
+Returns frame, first, last on success, or nil, errmsg, errno on failure. A
+non-blocking io fails with EAGAIN when no bytes are available, but once a frame has
+started, waits for up to gap for it to end.
+*/
+/* push the first len bytes as a frame, the rest were read at now */
+static int push_gap_frame(lua_State* L, struct buffer* buf, size_t len, const struct timespec* now)
+{
+    if (push_checked_frame(L, buf, buffer_bytes(buf), len) == 1) {
+        lua_pushnumber(L, ts_seconds(&buf->first));
+        lua_pushnumber(L, ts_seconds(&buf->last));
+    }
+
+    buffer_consume(buf, len);
+
+    buf->first = buf->last = *now;
+
+    return 3;
+}
+
+static int ltermios_readgap(lua_State* L)
+{
+    int fd = check_fileno(L, 1);
+    struct io_thread* io = opt_io_thread(L, 1);
+    lua_Number gap = luaL_checknumber(L, 2);
+    int max = luaL_optint(L, 3, FRAME_MAX);
+    struct timespec deadline;
+    const struct timespec* timeout = opt_deadline(L, 4, &deadline) ? &deadline : NULL;
+    struct buffer* buf = frame_buffer(L, fd);
+
+    luaL_argcheck(L, io == NULL, 1, "port has an io thread");
+    luaL_argcheck(L, gap > 0, 2, "must be positive");
+    luaL_argcheck(L, max > 0, 3, "must be positive");
+
+    for (;;) {
+        size_t len = buffer_len(buf);
+        struct timespec now;
+        ssize_t n;
+
+        /* left over from a frame reader with a larger max */
+        if (len > (size_t) max) {
+            return push_frame_too_long(L);
+        }
+
+        if (len == 0) {
+            check_wait_io(L, io, fd, POLLIN, timeout);
+        } else {
+            struct timespec end = buf->last;
+            int ready;
+
+            add_ms(&end, gap);
+
+            if (timeout && ts_before(timeout, &end)) {
+                ready = wait_fd(io_pollfd(io, fd, POLLIN), POLLIN, timeout);
+                if (ready == 0) {
+                    return push_timeout(L);
+                }
+            } else {
+                ready = wait_fd(io_pollfd(io, fd, POLLIN), POLLIN, &end);
+                if (ready == 0) {
+                    return push_gap_frame(L, buf, len, &end);
+                }
+            }
+
+            if (ready < 0) {
+                return push_error(L);
+            }
+        }
+
+        if (len >= (size_t) max) {
+            return push_frame_too_long(L);
+        }
+
+        /* a frame never grows past max, even by the bytes of one read */
+        n = buffer_fill_most(io, fd, buf, len + 1, max - len);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (n < 0) {
+            return push_error(L);
+        }
+
+        if (n == 0) {
+            if (len == 0) {
+                return 0;
+            }
+            return push_gap_frame(L, buf, len, &now);
+        }
+
+        if (len == 0) {
+            buf->first = now;
+        } else {
+            struct timespec end = buf->last;
+
+            add_ms(&end, gap);
+
+            /* the bytes of this read are after a gap, and start the next frame */
+            if (ts_before(&end, &now)) {
+                return push_gap_frame(L, buf, len, &now);
+            }
+        }
+
+        buf->last = now;
+    }
+}
+
+/*-
+-- seconds = termios.monotonic()
+
+The time on the monotonic clock, in seconds, as for the timestamps of
+termios.readgap().
+*/
+static int ltermios_monotonic(lua_State* L)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    lua_pushnumber(L, ts_seconds(&now));
+
+    return 1;
+}
+
+/*-
+-- port = termios.open(path, opts)
+
+Open path as by termios.open(path), but return a port object, rather than an fd
+number. A port can be used in place of an fd by all functions of this module, and
+has some of them as methods, see below.
+
+Opts is a table, with optional fields:
+- nonblock: true to open with O_NONBLOCK, rather than calling termios.setblocking()
+- cloexec: true to open with O_CLOEXEC, so the fd isn't inherited by exec'd processes
+- exclusive: true to lock the device with flock() and TIOCEXCL, failing with
+  EWOULDBLOCK if another process has it locked
+- profile: a profile to configure the port with, as for termios.configure_all()
+- thread: true to start a native io thread for the port, see below
+- rxsize, txsize: the sizes of the receive and transmit rings, default 65536
+- shared: true to share the port with other Lua states and threads, see below
+
+The port is configured before open returns, so there is no window where it is
+open with its previous settings in this process. Ports are closed when collected,
+or at the end of their scope when declared as local <close> in Lua 5.4.
+
+With an io thread, the thread reads from the device as soon as data arrives, into
+the receive ring, and writes from the transmit ring, so the device is serviced even
+while Lua is busy. termios.read(), termios.write(), and the frame readers then use
+the rings, and never block, failing with EAGAIN if the rings are empty or full, unless
+given a timeout, which waits for data or space in the rings. port:pollfd() becomes
+readable when data has been received, see termios.pollfd() for waiting for space
+in the transmit ring. If the receive ring is
+full, the thread drops incoming data, and counts it, see port:counters().
+
+A shared port is in a process-wide registry keyed by the real path of the device.
+Opening it again, from any Lua state in the process, returns a new port for the same
+fd, so a device can be handed between states by its path, and the fd is only closed
+when all its ports are closed. The ports share one copy of the cached attributes,
+behind a lock, and changes to attributes from different ports are merged, so
+concurrent changes of different attributes aren't lost, see port:lock() for changing
+several atomically. Opts other than profile apply to the first open only, and a
+shared port can't have an io thread. See also port:claim() for dividing ports
+between workers.
+
+Returns port on success, or nil, errmsg, errno on failure.
+*/
+/* Open and configure a device, returns the fd, or -1 with errno set. */
+static int open_device(const char* path, int flags, int exclusive,
+        const struct profile* profile, struct termios* termios)
+{
+    int fd = open(path, flags);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if ((exclusive && (flock(fd, LOCK_EX|LOCK_NB) < 0 || ioctl(fd, TIOCEXCL) < 0))
+            || profile_apply(fd, profile) < 0
+            || tcgetattr(fd, termios) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shared_port* shared_ports;
+
+static void shared_release(struct shared_port* shared);
+
+/* With shared_lock held, find a shared port by its real path, and reference it. */
+static struct shared_port* shared_find(const char* real)
+{
+    struct shared_port* shared;
+
+    for (shared = shared_ports; shared; shared = shared->next) {
+        if (strcmp(shared->path, real) == 0) {
+            shared->refs++;
+            return shared;
+        }
+    }
+
+    return NULL;
+}
+
+/* Configure a shared port found by another open, or release it on failure. */
+static struct shared_port* shared_configure(struct shared_port* shared, const struct profile* profile)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&shared->lock);
+    if (profile_apply(shared->fd, profile) < 0 || tcgetattr(shared->fd, &shared->termios) < 0) {
+        err = errno;
+    }
+    custom_bauds(shared->fd, &shared->termios, &shared->ibaud, &shared->obaud);
+    pthread_mutex_unlock(&shared->lock);
+
+    if (err) {
+        shared_release(shared);
+        errno = err;
+        return NULL;
+    }
+
+    return shared;
+}
+
+/* Find or open a shared port, and reference it, or return NULL with errno set. */
+static struct shared_port* shared_open(const char* path, int flags, int exclusive,
+        const struct profile* profile)
+{
+    char real[PATH_MAX];
+    struct shared_port* shared;
+    struct shared_port* found;
+    pthread_mutexattr_t attr;
+    int err;
+
+    if (realpath(path, real) == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shared_lock);
+    found = shared_find(real);
+    pthread_mutex_unlock(&shared_lock);
+
+    if (found) {
+        return shared_configure(found, profile);
+    }
+
+    if ((shared = calloc(1, sizeof(*shared))) == NULL || (shared->path = strdup(real)) == NULL) {
+        err = errno;
+        free(shared);
+        errno = err;
+        return NULL;
+    }
+
+    /* opened without the registry locked, as an open() can block, and a failure can be
+     * from another state opening it exclusively meanwhile, so it is looked up again */
+    shared->fd = open_device(path, flags, exclusive, profile, &shared->termios);
+    err = errno;
+
+    if (shared->fd >= 0) {
+        custom_bauds(shared->fd, &shared->termios, &shared->ibaud, &shared->obaud);
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&shared->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        shared->refs = 1;
+    }
+
+    pthread_mutex_lock(&shared_lock);
+    found = shared_find(real);
+    if (found == NULL && shared->fd >= 0) {
+        shared->next = shared_ports;
+        shared_ports = shared;
+    }
+    pthread_mutex_unlock(&shared_lock);
+
+    if (found == NULL && shared->fd >= 0) {
+        return shared;
+    }
+
+    /* lost the race, or failed */
+    if (shared->fd >= 0) {
+        close(shared->fd);
+        pthread_mutex_destroy(&shared->lock);
+    }
+    free(shared->path);
+    free(shared);
+
+    if (found == NULL) {
+        errno = err;
+        return NULL;
+    }
+
+    return shared_configure(found, profile);
+}
+
+static void shared_release(struct shared_port* shared)
+{
+    struct shared_port** p;
+    int refs;
+
+    pthread_mutex_lock(&shared_lock);
+
+    if ((refs = --shared->refs) == 0) {
+        for (p = &shared_ports; *p != shared; p = &(*p)->next)
+            ;
+        *p = shared->next;
+    }
+
+    pthread_mutex_unlock(&shared_lock);
+
+    if (refs == 0) {
+        close(shared->fd);
+        pthread_mutex_destroy(&shared->lock);
+        free(shared->path);
+        free(shared);
+    }
+}
+
+static int open_port(lua_State* L, const char* path, int index)
+{
+    struct port* port;
+    struct profile profile;
+    int thread;
+    int rxsize;
+    int txsize;
+    int exclusive;
+    int shared;
+    int flags = O_NOCTTY|O_RDWR;
+
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    thread = opt_field_boolean(L, index, "thread") > 0;
+    rxsize = opt_field_int(L, index, "rxsize", 1, 0x40000000);
+    txsize = opt_field_int(L, index, "txsize", 1, 0x40000000);
+    exclusive = opt_field_boolean(L, index, "exclusive") > 0;
+    shared = opt_field_boolean(L, index, "shared") > 0;
+
+    if (opt_field_boolean(L, index, "cloexec") > 0) {
+        flags |= O_CLOEXEC;
+    }
+
+    /* the io thread polls, and then must not block in read() */
+    if (thread || opt_field_boolean(L, index, "nonblock") > 0) {
+        flags |= O_NONBLOCK;
+    }
+
+    lua_getfield(L, index, "profile");
+    if (lua_isnil(L, -1)) {
+        profile_none(&profile);
+    } else {
+        check_profile(L, lua_gettop(L), &profile);
+    }
+    lua_pop(L, 1);
+
+    if (thread && profile.blocking > 0) {
+        luaL_error(L, "a port with an io thread can't be blocking");
+    }
+    if (thread && shared) {
+        luaL_error(L, "a shared port can't have an io thread");
+    }
+
+    port = lua_newuserdata(L, sizeof(*port));
+    memset(port, 0, sizeof(*port));
+    port->fd = -1;
+
+    luaL_getmetatable(L, PORTID);
+    lua_setmetatable(L, -2);
+
+    if (shared) {
+        if ((port->shared = shared_open(path, flags, exclusive, &profile)) == NULL) {
+            return push_error(L);
+        }
+
+        port->fd = port->shared->fd;
+
+        pthread_mutex_lock(&port->shared->lock);
+        port->seen = port->shared->termios;
+        pthread_mutex_unlock(&port->shared->lock);
+
+        return 1;
+    }
+
+    port->fd = open_device(path, flags, exclusive, &profile, &port->termios);
+
+    if (port->fd < 0) {
+        return push_error(L);
+    }
+
+    custom_bauds(port->fd, &port->termios, &port->ibaud, &port->obaud);
+
+    if (thread) {
+        port->io = io_thread_start(port->fd,
+                rxsize > 0 ? rxsize : RING_SIZE, txsize > 0 ? txsize : RING_SIZE);
+
+        if (port->io == NULL) {
+            int err = errno;
+            close(port->fd);
+            port->fd = -1;
+            errno = err;
+            return push_error(L);
+        }
+    }
+
+    return 1;
+}
+
+static struct port* check_port(lua_State* L, int index)
+{
+    struct port* port = luaL_checkudata(L, index, PORTID);
+
+    if (port->fd < 0)
+        luaL_error(L, "attempt to use a closed port");
+
+    return port;
+}
+
+static void port_close(struct port* port)
+{
+    if (port->shared) {
+        while (port->locks > 0) {
+            pthread_mutex_unlock(&port->shared->lock);
+            port->locks--;
+        }
+        if (port->claimed) {
+            pthread_mutex_lock(&shared_lock);
+            port->shared->claimed = 0;
+            pthread_mutex_unlock(&shared_lock);
+        }
+        shared_release(port->shared);
+        port->shared = NULL;
+        port->claimed = 0;
+        port->fd = -1;
+        return;
+    }
+    if (port->io) {
+        io_thread_stop(port->io);
+        port->io = NULL;
+    }
+    if (port->fd >= 0) {
+        close(port->fd);
+        port->fd = -1;
+    }
+}
+
+/* Close the port and forget its frames, unless the fd stays open for other ports. */
+static void port_close_frames(lua_State* L, struct port* port)
+{
+    int last = 1;
+
+    if (port->fd < 0) {
+        return;
+    }
+
+    if (port->shared) {
+        pthread_mutex_lock(&shared_lock);
+        last = port->shared->refs == 1;
+        pthread_mutex_unlock(&shared_lock);
+    }
+
+    if (last) {
+        forget_frames(L, port->fd);
+    }
+
+    port_close(port);
+}
+
+static int lport_gc(lua_State* L)
+{
+    port_close_frames(L, luaL_checkudata(L, 1, PORTID));
+
+    return 0;
+}
+
+/*-
+-- port:close()
+
+Close the port, stopping its io thread, if it has one. This happens anyway when the
+port is garbage-collected. Also termios.close(port).
+*/
+static int lport_close(lua_State* L)
+{
+    port_close_frames(L, check_port(L, 1));
+
+    return 0;
+}
+
+/*-
+-- fd = port:pollfd()
+
+Return the fd to register with a poller to wait for the port to be readable. With an
+io thread this is a pipe written when data is received, otherwise it is the port's
+fd.
+*/
+static int lport_pollfd(lua_State* L)
+{
+    struct port* port = check_port(L, 1);
+
+    lua_pushinteger(L, io_pollfd(port->io, port->fd, POLLIN));
+
+    return 1;
+}
+
+/*-
+-- counters = port:counters()
+
+Return the counters of the port's io thread, a table with fields:
+- rx_bytes, tx_bytes: the bytes received from and transmitted to the device
+- rx_overruns: the bytes received and dropped because the receive ring was full
+- rx_pending, tx_pending: the bytes in the receive and transmit rings
+- rx_size, tx_size: the sizes of the rings
+
+Returns counters on success, or nil, errmsg, errno if the port has no io thread. If the
+thread has stopped because of an error, counters.err and counters.errno are set.
+*/
+static int lport_counters(lua_State* L)
+{
+    struct port* port = check_port(L, 1);
+    struct io_thread* io = port->io;
+    int err;
+
+    if (io == NULL) {
+        return push_failure(L, EINVAL, "no io thread");
+    }
+
+    lua_createtable(L, 0, 9);
+
+#define COUNTER(name, value) lua_pushnumber(L, value); lua_setfield(L, -2, name)
+    COUNTER("rx_bytes", atomic_load(&io->rx_bytes));
+    COUNTER("tx_bytes", atomic_load(&io->tx_bytes));
+    COUNTER("rx_overruns", atomic_load(&io->rx_overruns));
+    COUNTER("rx_pending", ring_used(&io->rx));
+    COUNTER("tx_pending", ring_used(&io->tx));
+    COUNTER("rx_size", io->rx.size);
+    COUNTER("tx_size", io->tx.size);
+#undef COUNTER
+
+    if ((err = atomic_load(&io->err))) {
+        push_errmsg(L, err, NULL);
+        lua_setfield(L, -2, "err");
+        lua_pushinteger(L, err);
+        lua_setfield(L, -2, "errno");
+    }
+
+    return 1;
+}
+
+/*-
+-- attr = port:attr()
+
+Return the port's cached attributes, as termios.tcgetattr(port) does.
+
+The attributes of a port are cached when it is opened, and kept up to date by the
+functions of this module that change them, so reading them costs no tcgetattr(),
+and setting them to what they already are costs no tcsetattr().
+*/
+static int lport_attr(lua_State* L)
+{
+    check_port(L, 1);
+
+    return ltermios_tcgetattr(L);
+}
+
+/*-
+-- port = port:refresh()
+
+Re-read the port's cached attributes from the device, after they were changed
+other than through the port, such as by another process, or through the port's fd
+number.
+
+Returns port on success, or nil, errmsg, errno on failure.
+*/
+static int lport_refresh(lua_State* L)
+{
+    struct port* port = check_port(L, 1);
+
+    if (port_refresh(port) < 0) {
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- port = port:lock()
+-- port = port:trylock()
+-- port = port:unlock()
+
+Lock a shared port, so that other ports for the device, in any thread, wait to
+change or read its attributes until it is unlocked. Use it to change several
+attributes atomically. Locks are recursive and are held by the thread, so a port
+must be unlocked by the thread that locked it, and any locks are released when a
+port is closed.
+
+Trylock fails with EBUSY if the port is locked by another thread. Unlocking a port
+that the port doesn't hold locked is an error.
+
+Returns port on success, or nil, errmsg, errno on failure, with EINVAL if the port
+isn't shared.
+*/
+static struct port* check_shared(lua_State* L, int index)
+{
+    struct port* port = check_port(L, index);
+
+    if (port->shared == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return port;
+}
+
+static int lport_lock(lua_State* L)
+{
+    struct port* port = check_shared(L, 1);
+
+    if (port == NULL) {
+        return push_error(L);
+    }
+
+    pthread_mutex_lock(&port->shared->lock);
+    port->locks++;
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int lport_trylock(lua_State* L)
+{
+    struct port* port = check_shared(L, 1);
+    int err;
+
+    if (port == NULL) {
+        return push_error(L);
+    }
+
+    if ((err = pthread_mutex_trylock(&port->shared->lock)) != 0) {
+        errno = err;
+        return push_error(L);
+    }
+
+    port->locks++;
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int lport_unlock(lua_State* L)
+{
+    struct port* port = check_shared(L, 1);
+
+    if (port == NULL) {
+        return push_error(L);
+    }
+
+    if (port->locks == 0) {
+        return luaL_error(L, "port isn't locked");
+    }
+
+    port->locks--;
+    pthread_mutex_unlock(&port->shared->lock);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- port = port:claim()
+-- port = port:release()
+
+Claim a shared port for this port, or release the claim. Claims are advisory, they
+don't restrict the use of the device, but let workers divide a set of shared ports
+into disjoint shards, each worker claiming the ports it serves, and waiting on them
+with its own termios.poller(). A claim is released when the port that claimed it is
+closed.
+
+Claim fails with EBUSY if another port has claimed the device, and release does
+nothing unless this port has it claimed.
+
+Returns port on success, or nil, errmsg, errno on failure, with EINVAL if the port
+isn't shared.
+*/
+static int lport_claim(lua_State* L)
+{
+    struct port* port = check_shared(L, 1);
+    int busy;
+
+    if (port == NULL) {
+        return push_error(L);
+    }
+
+    pthread_mutex_lock(&shared_lock);
+    busy = port->shared->claimed && !port->claimed;
+    if (!busy) {
+        port->shared->claimed = port->claimed = 1;
+    }
+    pthread_mutex_unlock(&shared_lock);
+
+    if (busy) {
+        errno = EBUSY;
+        return push_error(L);
+    }
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int lport_release(lua_State* L)
+{
+    struct port* port = check_shared(L, 1);
+
+    if (port == NULL) {
+        return push_error(L);
+    }
+
+    pthread_mutex_lock(&shared_lock);
+    if (port->claimed) {
+        port->shared->claimed = port->claimed = 0;
+    }
+    pthread_mutex_unlock(&shared_lock);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+/*-
+-- fd = port:fileno()
+-- data = port:read(size[, timeout])
+-- count = port:read(buf[, timeout])
+-- written = port:write(data[, offset[, length[, timeout]]])
+-- written = port:writev(...)
+-- frame = port:readuntil(delim[, max[, timeout]])
+-- frame = port:readprefixed(size[, order[, max[, timeout]]])
+-- frame, first, last = port:readgap(gap[, max[, timeout]])
+-- count = port:inq()
+-- count = port:outq()
+
+The same as termios.fileno(port), termios.read(port, ...), etc.
+*/
+static const luaL_reg port_methods[] =
+{
+    {"__gc",              lport_gc},
+    {"__close",           lport_gc},
+    {"attr",              lport_attr},
+    {"refresh",           lport_refresh},
+    {"lock",              lport_lock},
+    {"trylock",           lport_trylock},
+    {"unlock",            lport_unlock},
+    {"claim",             lport_claim},
+    {"release",           lport_release},
+    {"close",             lport_close},
+    {"pollfd",            lport_pollfd},
+    {"counters",          lport_counters},
+    {"fileno",            ltermios_fileno},
+    {"read",              ltermios_read},
+    {"write",             ltermios_write},
+    {"writev",            ltermios_writev},
+    {"readuntil",         ltermios_readuntil},
+    {"readprefixed",      ltermios_readprefixed},
+    {"readgap",           ltermios_readgap},
+    {"writecrc",          ltermios_writecrc},
+    {"setframecheck",     ltermios_setframecheck},
+    {"inq",               ltermios_inq},
+    {"outq",              ltermios_outq},
+    {NULL, NULL}
+};
+
+/*-
+-- poller = termios.poller()
+
+Create a poller, to wait for many file descriptors at once to become readable or
+writable.
+
+The poller uses epoll() on Linux and kqueue() on BSD and OS X, so the cost of a
+wait is in proportion to the number of ready descriptors, not the number of
+registered ones. Elsewhere it uses poll().
+
+Returns poller on success, or nil, errmsg, errno on failure.
+*/
+#define POLL_READ  1
+#define POLL_WRITE 2
+
+#define POLLER_EVENTS 64
+
+struct poller {
+    int fd; /* the epoll or kqueue descriptor, -1 if closed */
+    int size; /* capacity of events */
+#if defined(HAVE_EPOLL)
+    struct epoll_event* events;
+#elif defined(HAVE_KQUEUE)
+    struct kevent* events;
+#else
+    struct pollfd* events; /* one for each registered descriptor */
+    int count;
+#endif
+};
+
+static struct poller* check_poller(lua_State* L, int index)
+{
+    struct poller* poller = luaL_checkudata(L, index, POLLERID);
+
+    if (poller->fd < 0)
+        luaL_error(L, "attempt to use a closed poller");
+
+    return poller;
+}
+
+static int check_mode(lua_State* L, int index)
+{
+    static const char* opts[] = { "r", "w", "rw", NULL };
+    static int opti[] = { POLL_READ, POLL_WRITE, POLL_READ|POLL_WRITE };
+
+    return opti[ luaL_checkoption(L, index, "r", opts) ];
+}
+
+static void push_mode(lua_State* L, int mode)
+{
+    switch (mode) {
+        case POLL_READ:            lua_pushliteral(L, "r"); break;
+        case POLL_WRITE:           lua_pushliteral(L, "w"); break;
+        default:                   lua_pushliteral(L, "rw"); break;
+    }
+}
+
+/* returns 0 on success, or -1 with errno set */
+static int poller_reserve(struct poller* poller, int size)
+{
+    void* events;
+
+    if (size <= poller->size) {
+        return 0;
+    }
+
+    events = realloc(poller->events, size * sizeof(poller->events[0]));
+
+    if (events == NULL) {
+        return -1;
+    }
+
+    poller->events = events;
+    poller->size = size;
+
+    return 0;
+}
+
+static int ltermios_poller(lua_State* L)
+{
+    struct poller* poller = lua_newuserdata(L, sizeof(*poller));
+
+    memset(poller, 0, sizeof(*poller));
+    poller->fd = -1;
+
+    luaL_getmetatable(L, POLLERID);
+    lua_setmetatable(L, -2);
+
+#if defined(HAVE_EPOLL)
+    poller->fd = epoll_create(POLLER_EVENTS);
+#elif defined(HAVE_KQUEUE)
+    poller->fd = kqueue();
+#else
+    poller->fd = 0;
+#endif
+
+    if (poller->fd < 0) {
+        return push_error(L);
+    }
+
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+    fcntl(poller->fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+    if (poller_reserve(poller, POLLER_EVENTS) < 0) {
+        return push_error(L);
+    }
+
+    return 1;
+}
+
+static void poller_close(struct poller* poller)
+{
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+    if (poller->fd >= 0) {
+        close(poller->fd);
+    }
+#endif
+    poller->fd = -1;
+
+    free(poller->events);
+    poller->events = NULL;
+    poller->size = 0;
+}
+
+static int lpoller_gc(lua_State* L)
+{
+    poller_close(luaL_checkudata(L, 1, POLLERID));
+
+    return 0;
+}
+
+/*-
+-- poller:close()
+
+Close the poller. This happens anyway when the poller is garbage-collected.
+*/
+static int lpoller_close(lua_State* L)
+{
+    poller_close(check_poller(L, 1));
+
+    return 0;
+}
+
+#if defined(HAVE_KQUEUE)
+static int poller_kevent(struct poller* poller, int fd, int filter, int on)
+{
+    struct kevent change;
+
+    EV_SET(&change, fd, filter, on ? EV_ADD : EV_DELETE, 0, 0, NULL);
+
+    if (kevent(poller->fd, &change, 1, NULL, 0, NULL) < 0) {
+        /* deleting a filter that wasn't added is not an error */
+        if (on || errno != ENOENT) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+#if !defined(HAVE_EPOLL) && !defined(HAVE_KQUEUE)
+static int poller_find(struct poller* poller, int fd)
 {
-    int fd = check_fileno(L, 1);
-    struct termios termios;
-    speed_t speed = 0;
-    int baud = 0;
     int i;
 
-    check_tcgetattr(L, fd, &termios);
+    for (i = 0; i < poller->count; i++) {
+        if (poller->events[i].fd == fd) {
+            return i;
+        }
+    }
 
-    speed = speedfn(&termios);
+    return -1;
+}
+#endif
 
-    for (i = 0; i < SPEEDS; i++) {
-        if (speeds[i].speed == speed) {
-            baud = speeds[i].baud;
-            break;
+/* returns 0 on success, or -1 with errno set */
+static int poller_add(struct poller* poller, int fd, int mode)
+{
+#if defined(HAVE_EPOLL)
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = (mode & POLL_READ ? EPOLLIN : 0) | (mode & POLL_WRITE ? EPOLLOUT : 0);
+    event.data.fd = fd;
+
+    if (epoll_ctl(poller->fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        if (errno != EEXIST) {
+            return -1;
         }
+        return epoll_ctl(poller->fd, EPOLL_CTL_MOD, fd, &event);
     }
 
-    if (i == SPEEDS) {
-        lua_pushnil(L);
-        lua_pushstring(L, "unsupported");
-        lua_pushnumber(L, ENOTSUP);
-        lua_pushnumber(L, speed);
-        return 4;
+    return 0;
+#elif defined(HAVE_KQUEUE)
+    if (poller_kevent(poller, fd, EVFILT_READ, mode & POLL_READ) < 0) {
+        return -1;
     }
+    return poller_kevent(poller, fd, EVFILT_WRITE, mode & POLL_WRITE);
+#else
+    int i = poller_find(poller, fd);
 
-    lua_pushnumber(L, baud);
+    if (i < 0) {
+        if (poller_reserve(poller, poller->count + 1) < 0) {
+            return -1;
+        }
+        i = poller->count++;
+    }
 
-    return 1;
-}
+    poller->events[i].fd = fd;
+    poller->events[i].events = (mode & POLL_READ ? POLLIN : 0) | (mode & POLL_WRITE ? POLLOUT : 0);
+    poller->events[i].revents = 0;
 
-static int ltermios_cfgetispeed(lua_State* L)
-{
-    return getspeed(L, cfgetispeed);
+    return 0;
+#endif
 }
-static int ltermios_cfgetospeed(lua_State* L)
+
+/* returns 0 on success, or -1 with errno set */
+static int poller_remove(struct poller* poller, int fd)
 {
-    return getspeed(L, cfgetospeed);
+#if defined(HAVE_EPOLL)
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+
+    return epoll_ctl(poller->fd, EPOLL_CTL_DEL, fd, &event);
+#elif defined(HAVE_KQUEUE)
+    if (poller_kevent(poller, fd, EVFILT_READ, 0) < 0) {
+        return -1;
+    }
+    return poller_kevent(poller, fd, EVFILT_WRITE, 0);
+#else
+    int i = poller_find(poller, fd);
+
+    if (i < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    poller->events[i] = poller->events[--poller->count];
+
+    return 0;
+#endif
 }
 
 /*-
--- io = termios.tcflush(io, direction)
+-- poller = poller:add(io, mode)
 
-See man page for tcflush()
+Register io with the poller, or change the mode of an already registered io.
 
-Direction is either "in", "out", or "both". It defaults to "both".
+Mode is "r" to wait for io to be readable, "w" for writable, or "rw" for either.
+Default is "r".
 
-Returns io on success, or nil, errmsg, errno on failure.
+Returns poller on success, or nil, errmsg, errno on failure.
 */
-static int ltermios_tcflush(lua_State *L)
+static int lpoller_add(lua_State* L)
 {
-    int fd = check_fileno(L, 1);
-
-    static const char* opts[] = { "in", "out", "both", NULL };
-    static int opti[] = { TCIFLUSH, TCOFLUSH, TCIOFLUSH };
-
-    int opt = opti[ luaL_checkoption(L, 2, "both", opts) ];
+    struct poller* poller = check_poller(L, 1);
+    int fd = check_fileno(L, 2);
+    int mode = check_mode(L, 3);
 
-    if(tcflush(fd, opt) < 0) {
+    if (poller_add(poller, fd, mode) < 0) {
         return push_error(L);
     }
 
@@ -475,17 +6388,19 @@ static int ltermios_tcflush(lua_State *L)
 }
 
 /*-
--- io = termios.tcdrain(io).
+-- poller = poller:remove(io)
 
-See man page for tcdrain()
+Unregister io from the poller. Closing a descriptor also unregisters it with
+epoll() and kqueue(), but not with poll(), so remove io before closing it.
 
-Returns io on success, or nil, errmsg, errno on failure.
+Returns poller on success, or nil, errmsg, errno on failure.
 */
-static int ltermios_tcdrain(lua_State *L)
+static int lpoller_remove(lua_State* L)
 {
-    int fd = check_fileno(L, 1);
+    struct poller* poller = check_poller(L, 1);
+    int fd = check_fileno(L, 2);
 
-    if(tcdrain(fd) < 0) {
+    if (poller_remove(poller, fd) < 0) {
         return push_error(L);
     }
 
@@ -495,91 +6410,342 @@ static int ltermios_tcdrain(lua_State *L)
 }
 
 /*-
--- io = termios.tcsendbreak(io, duration).
+-- fds, modes = poller:wait([timeout[, max]])
 
-See man page for tcsendbreak().
+Wait for registered descriptors to become ready.
 
-Duration is optional, and defaults to zero. If non-zero, its meaning is
-apparently implementation-defined, it might even be ignored.
+Timeout is in milliseconds, and if it is absent or negative, wait until a descriptor
+is ready. Max is the most descriptors to return from a single wait, and defaults
+to 64.
 
-Returns io on success, or nil, errmsg, errno on failure.
+Returns an array of ready fd numbers, and an array of their modes, "r", "w", or
+"rw". Error and hangup conditions are returned as readable, so that the error is
+found by the next read. Both arrays are empty if the wait timed out. With kqueue(),
+a descriptor ready for both reading and writing may be returned twice, once for
+each mode.
+
+Returns nil, errmsg, errno on failure, including EINTR if interrupted by a signal.
 */
-static int ltermios_tcsendbreak(lua_State *L)
+static int lpoller_wait(lua_State* L)
 {
-    int fd = check_fileno(L, 1);
-    int duration = luaL_optint(L, 2, 0);
+    struct poller* poller = check_poller(L, 1);
+    int timeout = luaL_optint(L, 2, -1);
+    int max = luaL_optint(L, 3, POLLER_EVENTS);
+    int n;
+    int i;
 
-    if(tcsendbreak(fd, duration) < 0) {
+    luaL_argcheck(L, max > 0, 3, "must be positive");
+
+#if defined(HAVE_EPOLL)
+    if (poller_reserve(poller, max) < 0) {
         return push_error(L);
     }
 
-    lua_settop(L, 1);
+    n = epoll_wait(poller->fd, poller->events, max, timeout < 0 ? -1 : timeout);
+#elif defined(HAVE_KQUEUE)
+    {
+        struct timespec ts;
 
-    return 1;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+        if (poller_reserve(poller, max) < 0) {
+            return push_error(L);
+        }
+
+        n = kevent(poller->fd, NULL, 0, poller->events, max, timeout < 0 ? NULL : &ts);
+    }
+#else
+    n = poll(poller->events, poller->count, timeout < 0 ? -1 : timeout);
+#endif
+
+    if (n < 0) {
+        return push_error(L);
+    }
+
+    lua_createtable(L, n, 0);
+    lua_createtable(L, n, 0);
+
+#if defined(HAVE_EPOLL)
+    for (i = 0; i < n; i++) {
+        uint32_t events = poller->events[i].events;
+        int mode = 0;
+
+        if (events & (EPOLLIN|EPOLLERR|EPOLLHUP)) {
+            mode |= POLL_READ;
+        }
+        if (events & EPOLLOUT) {
+            mode |= POLL_WRITE;
+        }
+
+        lua_pushinteger(L, poller->events[i].data.fd);
+        lua_rawseti(L, -3, i + 1);
+        push_mode(L, mode);
+        lua_rawseti(L, -2, i + 1);
+    }
+#elif defined(HAVE_KQUEUE)
+    for (i = 0; i < n; i++) {
+        lua_pushinteger(L, poller->events[i].ident);
+        lua_rawseti(L, -3, i + 1);
+        push_mode(L, poller->events[i].filter == EVFILT_WRITE ? POLL_WRITE : POLL_READ);
+        lua_rawseti(L, -2, i + 1);
+    }
+#else
+    {
+        int ready = 0;
+
+        for (i = 0; i < poller->count && ready < n && ready < max; i++) {
+            short revents = poller->events[i].revents;
+            int mode = 0;
+
+            if (revents == 0) {
+                continue;
+            }
+            if (revents & (POLLIN|POLLERR|POLLHUP|POLLNVAL)) {
+                mode |= POLL_READ;
+            }
+            if (revents & POLLOUT) {
+                mode |= POLL_WRITE;
+            }
+
+            ready++;
+
+            lua_pushinteger(L, poller->events[i].fd);
+            lua_rawseti(L, -3, ready);
+            push_mode(L, mode);
+            lua_rawseti(L, -2, ready);
+        }
+    }
+#endif
+
+    return 2;
 }
 
+static const luaL_reg poller_methods[] =
+{
+    {"__gc",              lpoller_gc},
+    {"close",             lpoller_close},
+    {"add",               lpoller_add},
+    {"remove",            lpoller_remove},
+    {"wait",              lpoller_wait},
+    {NULL, NULL}
+};
+
+#if defined(TERMIOS_STATS)
 /*-
--- io = termios.cfraw(io, when)
+-- stats = termios.stats(io)
+-- stats = termios.stats()
+-- termios.resetstats([io])
 
-See man page for cfmakeraw()
+Only present when built with make STATS=1.
 
-When is "now", "drain", or "flush". Default is "flush".
+Return the instrumentation for the fd of io, or for every fd that has any, as a table
+of stats keyed by fd. The stats for an fd are a table keyed by system call name
+("read", "write", "writev", "sendfile", "ioctl", "fcntl", "tcgetattr", "tcsetattr",
+"tcdrain", "tcflush", "tcsendbreak"), of tables with fields:
+- calls, errors: the number of calls, and of those that failed
+- bytes: the bytes transferred, for read, write, writev, and sendfile
+- total_ns, max_ns: the cumulative and maximum latency, in nanoseconds
+- histogram: array of counts, where histogram[i] counts calls taking at least
+  2^(i-1) nanoseconds, and less than 2^i, the last counts all longer calls
 
-Returns io on success, or nil, errmsg, errno on failure.
+And also the field errno, a table of error counts keyed by errno.
+
+Calls on an fd are recorded by all threads, including io threads and drain threads.
+Resetstats discards the stats of io, or of all fds. Stats are kept by fd number, and
+are discarded when the binding closes an fd, with termios.close(), port:close(), or
+a port being collected, so a reused number starts afresh. Fds closed by other means
+should be reset.
 */
-static int ltermios_cfraw(lua_State *L)
+static void push_stat_fd(lua_State* L, const struct stat_fd* stats)
 {
-    int fd = check_fileno(L, 1);
-    int opt = check_when(L, 2);
-    struct termios termios;
+    int op;
+    int i;
 
-    check_tcgetattr(L, fd, &termios);
+    lua_createtable(L, 0, STATS + 1);
 
-    cfmakeraw(&termios);
+    for (op = 0; op < STATS; op++) {
+        const struct stat_op* stat = &stats->ops[op];
+        int buckets = STAT_BUCKETS;
 
-    check_tcsetattr(L, fd, opt, &termios);
+        if (stat->calls == 0) {
+            continue;
+        }
 
-    lua_settop(L, 1);
+        while (buckets > 0 && stat->histogram[buckets - 1] == 0) {
+            buckets--;
+        }
+
+        lua_createtable(L, 0, 6);
+
+#define STAT(name, value) lua_pushnumber(L, value); lua_setfield(L, -2, name)
+        STAT("calls", stat->calls);
+        STAT("errors", stat->errors);
+        STAT("bytes", stat->bytes);
+        STAT("total_ns", stat->total_ns);
+        STAT("max_ns", stat->max_ns);
+#undef STAT
+
+        lua_createtable(L, buckets, 0);
+        for (i = 0; i < buckets; i++) {
+            lua_pushnumber(L, stat->histogram[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_setfield(L, -2, "histogram");
+
+        lua_setfield(L, -2, stat_names[op]);
+    }
+
+    lua_newtable(L);
+    for (i = 0; i < STAT_ERRNOS; i++) {
+        if (stats->errnos[i]) {
+            lua_pushnumber(L, stats->errnos[i]);
+            lua_rawseti(L, -2, i);
+        }
+    }
+    lua_setfield(L, -2, "errno");
+}
+
+static int ltermios_stats(lua_State *L)
+{
+    int fd = lua_isnoneornil(L, 1) ? -1 : check_fileno(L, 1);
+    struct stat_fd stats;
+    int i;
+
+    if (fd >= 0) {
+        memset(&stats, 0, sizeof(stats));
+
+        pthread_mutex_lock(&stat_lock);
+        if (fd < stat_nfds && stat_fds[fd]) {
+            stats = *stat_fds[fd];
+        }
+        pthread_mutex_unlock(&stat_lock);
+
+        push_stat_fd(L, &stats);
+
+        return 1;
+    }
+
+    lua_newtable(L);
+
+    for (i = 0; ; i++) {
+        int found = 0;
+
+        /* copied out, so the lock isn't held while allocating lua objects */
+        pthread_mutex_lock(&stat_lock);
+        if (i < stat_nfds && stat_fds[i]) {
+            stats = *stat_fds[i];
+            found = 1;
+        }
+        fd = stat_nfds;
+        pthread_mutex_unlock(&stat_lock);
+
+        if (i >= fd) {
+            break;
+        }
+
+        if (found) {
+            push_stat_fd(L, &stats);
+            lua_rawseti(L, -2, i);
+        }
+    }
 
     return 1;
 }
 
-/*-
--- fd = termios.open(path)
+static int ltermios_resetstats(lua_State *L)
+{
+    int fd = lua_isnoneornil(L, 1) ? -1 : check_fileno(L, 1);
+    int i;
 
-The path must exist, and is opened read-write.
+    pthread_mutex_lock(&stat_lock);
+    for (i = 0; i < stat_nfds; i++) {
+        if (stat_fds[i] && (fd < 0 || fd == i)) {
+            memset(stat_fds[i], 0, sizeof(struct stat_fd));
+        }
+    }
+    pthread_mutex_unlock(&stat_lock);
 
-Returns fd on success, or nil, errmsg, errno on failure.
+    return 0;
+}
+#endif
+
+/*-
+-- ports = termios.shared()
+
+List the shared ports open in the process, see termios.open(), as an array of tables
+with fields path, fd, refs, the number of ports for it, and claimed, true if a port
+has claimed it.
 */
-/* Could I depend on luaposix for this? */
-static int ltermios_open(lua_State* L)
+static int ltermios_shared(lua_State *L)
 {
-    const char* path = luaL_checkstring(L, 1);
-    int fd = open(path, O_NOCTTY|O_RDWR);
+    struct shared_port* shared;
+    int i = 0;
 
-    if (fd < 0) {
-        return push_error(L);
+    lua_newtable(L);
+
+    /* lua may raise out of memory, with the lock held, but only a process that is
+     * about to fail anyway would then deadlock */
+    pthread_mutex_lock(&shared_lock);
+
+    for (shared = shared_ports; shared; shared = shared->next) {
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, shared->path);
+        lua_setfield(L, -2, "path");
+        lua_pushinteger(L, shared->fd);
+        lua_setfield(L, -2, "fd");
+        lua_pushinteger(L, shared->refs);
+        lua_setfield(L, -2, "refs");
+        lua_pushboolean(L, shared->claimed);
+        lua_setfield(L, -2, "claimed");
+        lua_rawseti(L, -2, ++i);
     }
 
-    lua_pushinteger(L, fd);
+    pthread_mutex_unlock(&shared_lock);
 
     return 1;
 }
 
 /*-
--- termios.close(fd)
+-- was = termios.errors([mode])
 
-Close an fd, which must be a number, not an io object.
+Set how failures are returned, mode is one of:
+- "messages": nil, errmsg, errno, the default
+- "codes": nil, errno, errno, so the errmsg is the errno number
 
-Returns nothing on success, or nil, errmsg, errno on failure.
+The mode applies to every errmsg, including the err fields of the results of
+termios.configure_all() and port:counters(). Messages are cached after their first
+use, so a repeated failure creates no strings. Mode is for this Lua state, and when
+it is nil it is unchanged.
+
+Returns the previous mode.
 */
-static int ltermios_close(lua_State *L)
+static void ltermios_newerrors(lua_State* L)
 {
-    if (close(luaL_checkint(L, 1)) < 0) {
-            return push_error(L);
+    lua_createtable(L, 0, 1);
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "codes");
+    lua_setfield(L, LUA_REGISTRYINDEX, ERRORSID);
+}
+
+static int ltermios_errors(lua_State *L)
+{
+    static const char* opts[] = { "messages", "codes", NULL };
+    int codes;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, ERRORSID);
+    lua_getfield(L, -1, "codes");
+    codes = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    if (!lua_isnoneornil(L, 1)) {
+        lua_pushboolean(L, luaL_checkoption(L, 1, NULL, opts));
+        lua_setfield(L, -2, "codes");
     }
 
-    return 0;
+    lua_pushstring(L, opts[codes]);
+
+    return 1;
 }
 
 static const luaL_reg termios[] =
@@ -589,26 +6755,314 @@ static const luaL_reg termios[] =
     {"setcanonical",      ltermios_setcanonical},
     {"tcflush",           ltermios_tcflush},
     {"tcdrain",           ltermios_tcdrain},
+    {"drain",             ltermios_drain},
     {"tcsendbreak",       ltermios_tcsendbreak},
+    {"getrs485",          ltermios_getrs485},
+    {"setrs485",          ltermios_setrs485},
+    {"setlowlatency",     ltermios_setlowlatency},
+    {"latencytimer",      ltermios_latencytimer},
+    {"tiocmget",          ltermios_tiocmget},
+    {"tiocmset",          ltermios_tiocmset},
+    {"tiocmbis",          ltermios_tiocmbis},
+    {"tiocmbic",          ltermios_tiocmbic},
+    {"modemchange",       ltermios_modemchange},
+    {"waitmodem",         ltermios_waitmodem},
     {"cfraw",             ltermios_cfraw},
+    {"setvmin",           ltermios_setvmin},
+    {"setflowcontrol",    ltermios_setflowcontrol},
     {"cfsetspeed",        ltermios_cfsetspeed},
     {"cfsetispeed",       ltermios_cfsetispeed},
     {"cfsetospeed",       ltermios_cfsetospeed},
     {"cfgetispeed",       ltermios_cfgetispeed},
     {"cfgetospeed",       ltermios_cfgetospeed},
+    {"tcgetattr",         ltermios_tcgetattr},
+    {"tcsetattr",         ltermios_tcsetattr},
     {"open",              ltermios_open},
     {"close",             ltermios_close},
+    {"configure_all",     ltermios_configure_all},
+    {"openpty",           ltermios_openpty},
+    {"shared",            ltermios_shared},
+    {"read",              ltermios_read},
+    {"write",             ltermios_write},
+    {"writev",            ltermios_writev},
+    {"sendfile",          ltermios_sendfile},
+    {"buffer",            ltermios_buffer},
+    {"poller",            ltermios_poller},
+    {"framebuffer",       ltermios_framebuffer},
+    {"readuntil",         ltermios_readuntil},
+    {"readprefixed",      ltermios_readprefixed},
+    {"inq",               ltermios_inq},
+    {"outq",              ltermios_outq},
+    {"pollfd",            ltermios_pollfd},
+    {"waitfd",            ltermios_waitfd},
+    {"readgap",           ltermios_readgap},
+    {"monotonic",         ltermios_monotonic},
+    {"checksum",          ltermios_checksum},
+    {"writecrc",          ltermios_writecrc},
+    {"setframecheck",     ltermios_setframecheck},
+    {"errors",            ltermios_errors},
+#if defined(TERMIOS_STATS)
+    {"stats",             ltermios_stats},
+    {"resetstats",        ltermios_resetstats},
+#endif
     {NULL, NULL}
 };
 
+/*-
+-- termios.co
+
+Wrappers of the io functions for running sessions as coroutines: read, write,
+writev, writecrc, readuntil, readprefixed, readgap, and tcdrain. On a non-blocking
+io, when the wrapped function fails with EAGAIN, the wrapper calls
+termios.co.hook(fd, mode, timeout) and then retries, where fd and mode are what to
+wait for, as for termios.waitfd().
+
+A timeout passed to a wrapper is not passed on to the wrapped function, which would
+block in it, but is the longest the wrapper retries for, with the hook getting the
+time remaining. When it expires, the wrapper fails with ETIMEDOUT as the wrapped
+function would.
+
+The default hook, in a coroutine, yields "wait", fd, mode, timeout to the
+scheduler that resumed it, which should resume it when fd is ready, for example
+after registering fd with a termios.poller(). Out of a coroutine, it blocks in
+termios.waitfd(). Assign termios.co.hook to use another scheduler.
+
+Fd is nil when there is nothing to wait on, and the hook should then wait for
+timeout milliseconds, though the wrappers always have an fd, see termios.pollfd().
+co.tcdrain() waits for a termios.drain() instead of blocking in tcdrain().
+*/
+static const char co_lua[] =
+    "local termios, EAGAIN = ...\n"
+    "local running, yield = coroutine.running, coroutine.yield\n"
+    "local co = {}\n"
+    "function co.hook(fd, mode, timeout)\n"
+    "  local thread, main = running()\n"
+    "  if thread and not main then\n"
+    "    return yield('wait', fd, mode, timeout)\n"
+    "  end\n"
+    "  return termios.waitfd(fd, mode, timeout)\n"
+    "end\n"
+    "local unpack, select = table.unpack or unpack, select\n"
+    "-- at is the position of the timeout in the arguments after io, and if\n"
+    "-- tableonly, there is only one if the first argument is a table\n"
+    "local function wrap(name, mode, at, tableonly)\n"
+    "  local fn = termios[name]\n"
+    "  co[name] = function(io, ...)\n"
+    "    local n, args = select('#', ...), { ... }\n"
+    "    local deadline\n"
+    "    if n >= at and (not tableonly or type(args[1]) == 'table') then\n"
+    "      if args[at] then\n"
+    "        deadline = termios.monotonic() + args[at] / 1000\n"
+    "      end\n"
+    "      args[at] = nil\n"
+    "    end\n"
+    "    local fd, wmode = termios.pollfd(io, mode)\n"
+    "    while true do\n"
+    "      local r1, r2, r3 = fn(io, unpack(args, 1, n))\n"
+    "      if r1 ~= nil or r3 ~= EAGAIN then\n"
+    "        return r1, r2, r3\n"
+    "      end\n"
+    "      local remaining = deadline and (deadline - termios.monotonic()) * 1000\n"
+    "      if remaining and remaining <= 0 then\n"
+    "        -- a last try, that fails with the timeout of fn if still not ready\n"
+    "        args[at] = 0\n"
+    "        return fn(io, unpack(args, 1, n))\n"
+    "      end\n"
+    "      co.hook(fd, wmode, remaining)\n"
+    "    end\n"
+    "  end\n"
+    "end\n"
+    "wrap('read', 'r', 2)\n"
+    "wrap('readuntil', 'r', 3)\n"
+    "wrap('readprefixed', 'r', 4)\n"
+    "wrap('readgap', 'r', 3)\n"
+    "wrap('write', 'w', 4)\n"
+    "wrap('writev', 'w', 3, true)\n"
+    "wrap('writecrc', 'w', 4)\n"
+    "function co.tcdrain(io)\n"
+    "  local drain, emsg, errno = termios.drain(io)\n"
+    "  if not drain then\n"
+    "    return nil, emsg, errno\n"
+    "  end\n"
+    "  while true do\n"
+    "    local done\n"
+    "    done, emsg, errno = drain:done()\n"
+    "    if done then\n"
+    "      return io\n"
+    "    elseif done == nil then\n"
+    "      return nil, emsg, errno\n"
+    "    end\n"
+    "    co.hook(drain:pollfd(), 'r')\n"
+    "  end\n"
+    "end\n"
+    "return co\n";
+
+static void ltermios_newco(lua_State* L)
+{
+    if (luaL_loadbuffer(L, co_lua, sizeof(co_lua) - 1, "=termios.co")) {
+        lua_error(L);
+    }
+
+    lua_pushvalue(L, -2);
+    lua_pushinteger(L, EAGAIN);
+    lua_call(L, 2, 1);
+}
+
+/*-
+-- termios.modem
+
+Table of modem line names to their bits, for use with termios.tiocmget().
+*/
+static void ltermios_newmodem(lua_State* L)
+{
+    int i;
+
+    lua_createtable(L, 0, MODEMS);
+
+    for (i = 0; i < MODEMS; i++) {
+        lua_pushinteger(L, modems[i].bit);
+        lua_setfield(L, -2, modems[i].name);
+    }
+}
+
+/*-
+-- termios.cdef
+
+The C declarations of functions for calling from LuaJIT's FFI, without the cost of
+the Lua C function call for each read or write. They take fd numbers, not ports or
+files, and read and write the fd directly, so shouldn't be used on a port with an io
+thread. Use them as:
+
+  local ffi = require"ffi"
+  ffi.cdef(termios.cdef)
+  local C = ffi.load(package.searchpath("termios", package.cpath))
+  local buf = ffi.new("char[?]", 256)
+  local n = C.termios_ffi_read(fd, buf, 256, 100)
+
+Timeouts are in milliseconds, and negative to not wait. The read and write functions
+return the number of bytes transferred, or -1 on failure, with ffi.errno() set, and
+ETIMEDOUT if the timeout expires. The wait function, for events of 1 for readable and
+2 for writable, returns 1 if ready, or -1 on failure, with ETIMEDOUT if the timeout
+expires, and a negative timeout waits forever.
+
+The checksum function is termios.checksum(), with kind 1 to 5 for "crc16", "crc32",
+"crc32c", "lrc", and "xor", and init required, 0xFFFF for crc16 and 0 for the rest.
+*/
+static const char cdef[] =
+    "ssize_t termios_ffi_read(int fd, void* data, size_t size, int timeout);\n"
+    "ssize_t termios_ffi_write(int fd, const void* data, size_t size, int timeout);\n"
+    "int termios_ffi_wait(int fd, int events, int timeout);\n"
+    "uint32_t termios_ffi_checksum(int kind, uint32_t init, const void* data, size_t size);\n";
+
+static int ffi_wait(int fd, short events, int timeout)
+{
+    struct timespec deadline;
+    int ready;
+
+    if (timeout < 0) {
+        return 1;
+    }
+
+    set_deadline(&deadline, timeout);
+
+    if ((ready = wait_fd(fd, events, &deadline)) == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return ready;
+}
+
+LUALIB_API ssize_t termios_ffi_read(int fd, void* data, size_t size, int timeout)
+{
+    if (ffi_wait(fd, POLLIN, timeout) < 0) {
+        return -1;
+    }
+
+    return read(fd, data, size);
+}
+
+LUALIB_API ssize_t termios_ffi_write(int fd, const void* data, size_t size, int timeout)
+{
+    if (ffi_wait(fd, POLLOUT, timeout) < 0) {
+        return -1;
+    }
+
+    return write(fd, data, size);
+}
+
+LUALIB_API uint32_t termios_ffi_checksum(int kind, uint32_t init, const void* data, size_t size)
+{
+    return checksum(kind, init, data, size);
+}
+
+LUALIB_API int termios_ffi_wait(int fd, int events, int timeout)
+{
+    short pevents = (events & 1 ? POLLIN : 0) | (events & 2 ? POLLOUT : 0);
+
+    if (timeout < 0) {
+        struct pollfd pfd;
+        int ready;
+
+        pfd.fd = fd;
+        pfd.events = pevents;
+        pfd.revents = 0;
+
+        do {
+            ready = poll(&pfd, 1, -1);
+        } while (ready < 0 && errno == EINTR);
+
+        return ready;
+    }
+
+    return ffi_wait(fd, pevents, timeout);
+}
+
+static void newmetatable(lua_State* L, const char* regid, const luaL_reg* methods)
+{
+    luaL_newmetatable(L, regid);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, methods, 0);
+#else
+    luaL_register(L, NULL, methods);
+#endif
+    lua_pop(L, 1);
+}
+
 LUALIB_API int luaopen_termios (lua_State *L)
 {
+    ltermios_newerrors(L);
+
+    newmetatable(L, REGID, attr_methods);
+    newmetatable(L, BUFFERID, buffer_methods);
+    newmetatable(L, POLLERID, poller_methods);
+    newmetatable(L, PORTID, port_methods);
+    newmetatable(L, DRAINID, drain_methods);
+
+#if LUA_VERSION_NUM >= 502
+    luaL_newlib(L, termios);
+#else
     luaL_register(L, "termios", termios);
+#endif
 
     ltermios_newspeeds(L);
 
     lua_setfield(L, -2, "speeds");
 
+    ltermios_newmodem(L);
+
+    lua_setfield(L, -2, "modem");
+
+    ltermios_newco(L);
+
+    lua_setfield(L, -2, "co");
+
+    lua_pushlstring(L, cdef, sizeof(cdef) - 1);
+
+    lua_setfield(L, -2, "cdef");
+
     return 1;
 }
 
@@ -0,0 +1,98 @@
+/*
+Copyright (c) 2011 Wurldtech Security Technologies All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+PURPOSE ARE DISCLAIMED.IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+Linux struct termios2 support, for baud rates that have no speed_t constant.
+
+This is apart from termios.c because <asm/termbits.h> conflicts with <termios.h>.
+*/
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+/* Negative bauds are left as is, an input baud of zero follows the output baud.
+ * Returns 0 on success, or -1 with errno set. */
+int termios2_setbaud(int fd, int when, int ibaud, int obaud)
+{
+    struct termios2 termios;
+    int request;
+
+    switch (when) {
+        case TCSANOW:   request = TCSETS2; break;
+        case TCSADRAIN: request = TCSETSW2; break;
+        case TCSAFLUSH: request = TCSETSF2; break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (ioctl(fd, TCGETS2, &termios) < 0) {
+        return -1;
+    }
+
+    if (obaud >= 0) {
+        termios.c_cflag &= ~CBAUD;
+        termios.c_cflag |= BOTHER;
+        termios.c_ospeed = obaud;
+    }
+
+    if (ibaud >= 0) {
+        termios.c_cflag &= ~(CBAUD << IBSHIFT);
+        if (ibaud > 0) {
+            termios.c_cflag |= BOTHER << IBSHIFT;
+        }
+        termios.c_ispeed = ibaud;
+    }
+
+    return ioctl(fd, request, &termios);
+}
+
+/* The kernel reports the actual rates, whether or not they were set with BOTHER.
+ * Returns 0 on success, or -1 with errno set. */
+int termios2_getbaud(int fd, int* ibaud, int* obaud)
+{
+    struct termios2 termios;
+
+    if (ioctl(fd, TCGETS2, &termios) < 0) {
+        return -1;
+    }
+
+    *ibaud = termios.c_ispeed;
+    *obaud = termios.c_ospeed;
+
+    return 0;
+}
+
+#else
+
+/* ISO C does not allow an empty translation unit */
+typedef int termios2_unused;
+
+#endif
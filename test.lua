@@ -0,0 +1,368 @@
+--[[
+Correctness tests of the termios binding on pseudo-terminal pairs, run by make test.
+
+Prints one line per test, and fails at the end if any test didn't pass.
+
+Usage: termios-bench test.lua
+]]
+
+local termios = require"termios"
+
+local tests = {}
+
+local function test(name, fn)
+    tests[#tests + 1] = { name = name, fn = fn }
+end
+
+local function eq(got, want, what)
+    if got ~= want then
+        error(string.format("%s: got %s, want %s", what or "value", tostring(got),
+            tostring(want)), 2)
+    end
+end
+
+local function fails(errmsg, want, what)
+    eq(errmsg, want, (what or "call") .. " errmsg")
+end
+
+local function openpty()
+    return assert(termios.openpty{ raw = true })
+end
+
+local function closepty(master, slave)
+    termios.close(slave)
+    termios.close(master)
+end
+
+local function bytes(...)
+    return string.char(...)
+end
+
+-- a read returns as soon as any data is available, so gather all of it
+local function readn(io, size)
+    local data = ""
+    while #data < size do
+        data = data .. assert(termios.read(io, size - #data, 1000))
+    end
+    return data
+end
+
+test("read times out", function()
+    local master, slave = openpty()
+    local start = termios.monotonic()
+    local data, errmsg = termios.read(slave, 1, 50)
+    local elapsed = termios.monotonic() - start
+
+    eq(data, nil, "data")
+    fails(errmsg, "timeout", "read")
+    assert(elapsed >= 0.04, "returned after " .. elapsed .. "s")
+
+    assert(termios.write(master, "x"))
+    eq(readn(slave, 1), "x", "data")
+
+    closepty(master, slave)
+end)
+
+test("write times out", function()
+    local master, slave = openpty()
+    local chunk = string.rep("w", 4096)
+    local written = 0
+    local n, errmsg
+
+    assert(termios.setblocking(slave, false))
+
+    -- nobody reads the master, so its input fills up, down to the last byte
+    for _, data in ipairs{ chunk, "w" } do
+        repeat
+            n = termios.write(slave, data)
+            written = written + (n or 0)
+            assert(written < 16 * 1024 * 1024, "pty never filled up")
+        until not n
+    end
+
+    n, errmsg = termios.write(slave, "x", 1, 1, 50)
+
+    eq(n, nil, "written")
+    fails(errmsg, "timeout", "write")
+
+    closepty(master, slave)
+end)
+
+test("readuntil", function()
+    local master, slave = openpty()
+
+    assert(termios.write(master, "abc\r\ndef\r\n\r\ngh"))
+
+    eq(termios.readuntil(slave, "\r\n", nil, 1000), "abc", "frame")
+    eq(termios.readuntil(slave, "\r\n", nil, 1000), "def", "frame")
+    eq(termios.readuntil(slave, "\r\n", nil, 1000), "", "frame")
+
+    -- a partial frame stays buffered when the read times out
+    local frame, errmsg = termios.readuntil(slave, "\r\n", nil, 50)
+    eq(frame, nil, "frame")
+    fails(errmsg, "timeout", "readuntil")
+    eq(termios.framebuffer(slave):len(), 2, "buffered")
+
+    assert(termios.write(master, "i\r\n"))
+    eq(termios.readuntil(slave, "\r\n", nil, 1000), "ghi", "frame")
+    eq(termios.framebuffer(slave):len(), 0, "buffered")
+
+    -- too long for max, the bytes stay buffered
+    assert(termios.write(master, "0123456789\n"))
+    frame, errmsg = termios.readuntil(slave, "\n", 4, 1000)
+    eq(frame, nil, "frame")
+    assert(errmsg, "readuntil past max")
+    eq(termios.readuntil(slave, "\n", nil, 1000), "0123456789", "frame")
+
+    closepty(master, slave)
+end)
+
+test("readprefixed", function()
+    local master, slave = openpty()
+
+    assert(termios.write(master, bytes(3) .. "one" .. bytes(0, 3) .. "two"
+        .. bytes(5, 0) .. "three" .. bytes(0, 0, 0, 4) .. "four" .. bytes(0)))
+
+    eq(termios.readprefixed(slave, 1, nil, nil, 1000), "one", "frame")
+    eq(termios.readprefixed(slave, 2, "big", nil, 1000), "two", "frame")
+    eq(termios.readprefixed(slave, 2, "little", nil, 1000), "three", "frame")
+    eq(termios.readprefixed(slave, 4, "big", nil, 1000), "four", "frame")
+    eq(termios.readprefixed(slave, 1, nil, nil, 1000), "", "frame")
+
+    -- a partial frame stays buffered when the read times out
+    assert(termios.write(master, bytes(6) .. "par"))
+    local frame, errmsg = termios.readprefixed(slave, 1, nil, nil, 50)
+    eq(frame, nil, "frame")
+    fails(errmsg, "timeout", "readprefixed")
+
+    assert(termios.write(master, "tly"))
+    eq(termios.readprefixed(slave, 1, nil, nil, 1000), "partly", "frame")
+
+    -- longer than max, the bytes stay buffered
+    assert(termios.write(master, bytes(5) .. "again"))
+    frame, errmsg = termios.readprefixed(slave, 1, nil, 4, 1000)
+    eq(frame, nil, "frame")
+    assert(errmsg, "readprefixed past max")
+    eq(termios.readprefixed(slave, 1, nil, nil, 1000), "again", "frame")
+
+    closepty(master, slave)
+end)
+
+test("readgap", function()
+    local master, slave = openpty()
+
+    assert(termios.write(master, "abcd"))
+    local frame, first, last = termios.readgap(slave, 20, 4, 1000)
+    eq(frame, "abcd", "frame")
+    assert(first <= last, "first after last")
+
+    -- no read goes past max
+    assert(termios.write(master, "0123456789"))
+    local errmsg
+    frame, errmsg = termios.readgap(slave, 20, 4, 1000)
+    eq(frame, nil, "frame")
+    assert(errmsg, "readgap past max")
+    eq(termios.framebuffer(slave):len(), 4, "buffered")
+    eq(termios.readgap(slave, 20, nil, 1000), "0123456789", "frame")
+
+    closepty(master, slave)
+end)
+
+-- the check values of the catalogue of CRCs, for "123456789"
+local vectors = {
+    { "crc16", 0x4B37 },
+    { "crc32", 0xCBF43926 },
+    { "crc32c", 0xE3069283 },
+    { "lrc", 0x23 },
+    { "xor", 0x31 },
+}
+
+test("checksum known answers", function()
+    for _, v in ipairs(vectors) do
+        local kind, sum = v[1], v[2]
+
+        eq(termios.checksum(kind, "123456789"), sum, kind)
+        eq(termios.checksum(kind, "56789", termios.checksum(kind, "1234")), sum,
+            kind .. " in parts")
+
+        -- long enough for the wide kernels, split off their alignment
+        local long = string.rep("123456789", 1000)
+        eq(termios.checksum(kind, long:sub(4), termios.checksum(kind, long:sub(1, 3))),
+            termios.checksum(kind, long), kind .. " long in parts")
+    end
+end)
+
+test("checksum of a buffer", function()
+    local master, slave = openpty()
+    local buf = termios.buffer(64)
+
+    assert(termios.write(master, "123456789"))
+    while buf:len() < 9 do
+        assert(termios.read(slave, buf, 1000))
+    end
+
+    for _, v in ipairs(vectors) do
+        eq(termios.checksum(v[1], buf), v[2], v[1])
+    end
+
+    closepty(master, slave)
+end)
+
+test("writecrc", function()
+    local master, slave = openpty()
+
+    eq(termios.writecrc(master, "123456789", "crc16"), 11, "written")
+    eq(readn(slave, 11), "123456789" .. bytes(0x37, 0x4B), "frame")
+
+    eq(termios.writecrc(master, "123456789", "crc32"), 13, "written")
+    eq(readn(slave, 13), "123456789" .. bytes(0x26, 0x39, 0xF4, 0xCB), "frame")
+
+    eq(termios.writecrc(master, "123456789", "lrc"), 10, "written")
+    eq(readn(slave, 10), "123456789" .. bytes(0x23), "frame")
+
+    closepty(master, slave)
+end)
+
+test("setframecheck", function()
+    local master, slave = openpty()
+
+    assert(termios.setframecheck(slave, "crc16"))
+
+    assert(termios.write(master, bytes(11)))
+    assert(termios.writecrc(master, "123456789", "crc16"))
+    eq(termios.readprefixed(slave, 1, nil, nil, 1000), "123456789", "frame")
+
+    assert(termios.write(master, "123456789" .. bytes(0x37, 0x4B) .. "\n"))
+    eq(termios.readuntil(slave, "\n", nil, 1000), "123456789", "frame")
+
+    -- a bad frame is discarded, and the next one still read
+    assert(termios.write(master, "123456789" .. bytes(0x4B, 0x37) .. "\n"))
+    local frame, errmsg = termios.readuntil(slave, "\n", nil, 1000)
+    eq(frame, nil, "frame")
+    fails(errmsg, "checksum mismatch", "readuntil")
+
+    assert(termios.write(master, "123456789" .. bytes(0x37, 0x4B) .. "\n"))
+    eq(termios.readuntil(slave, "\n", nil, 1000), "123456789", "frame")
+
+    -- too short to have a checksum
+    assert(termios.write(master, "1\n"))
+    frame, errmsg = termios.readuntil(slave, "\n", nil, 1000)
+    eq(frame, nil, "frame")
+    fails(errmsg, "checksum mismatch", "readuntil")
+
+    assert(termios.setframecheck(slave, nil))
+    assert(termios.write(master, "12\n"))
+    eq(termios.readuntil(slave, "\n", nil, 1000), "12", "frame")
+
+    closepty(master, slave)
+end)
+
+local function check_attr(io)
+    local attr = assert(termios.tcgetattr(io))
+
+    assert(attr:cfsetspeed(38400))
+    assert(attr:setflag("ECHO", true))
+    assert(attr:setflag("CLOCAL", true))
+    assert(attr:setvmin(3, 4))
+    assert(termios.tcsetattr(io, attr, "now"))
+
+    for _, got in ipairs{ assert(termios.tcgetattr(io)),
+            assert(termios.tcgetattr(termios.fileno(io))) } do
+        eq(got:cfgetispeed(), 38400, "ispeed")
+        eq(got:cfgetospeed(), 38400, "ospeed")
+        eq(got:getflag("ECHO"), true, "ECHO")
+        eq(got:getflag("CLOCAL"), true, "CLOCAL")
+        local vmin, vtime = got:getvmin()
+        eq(vmin, 3, "vmin")
+        eq(vtime, 4, "vtime")
+    end
+
+    assert(termios.cfsetspeed(io, 9600, "now"))
+    assert(termios.setcanonical(io, true, "now"))
+    eq(termios.cfgetospeed(io), 9600, "ospeed")
+    eq(termios.tcgetattr(termios.fileno(io)):cfgetospeed(), 9600, "ospeed")
+    eq(termios.tcgetattr(termios.fileno(io)):getflag("ICANON"), true, "ICANON")
+
+    assert(termios.cfraw(io, "now"))
+    eq(termios.tcgetattr(termios.fileno(io)):getflag("ICANON"), false, "ICANON")
+    eq(termios.tcgetattr(io):getflag("ICANON"), false, "ICANON")
+end
+
+test("attr round trip on an fd", function()
+    local master, slave = openpty()
+
+    check_attr(slave)
+
+    closepty(master, slave)
+end)
+
+test("attr round trip on a port", function()
+    local master, slave, path = openpty()
+    local port = assert(termios.open(path, { profile = { raw = true } }))
+
+    check_attr(port)
+
+    port:close()
+    closepty(master, slave)
+end)
+
+test("shared port merging", function()
+    local master, slave, path = openpty()
+    local a = assert(termios.open(path, { shared = true }))
+    local b = assert(termios.open(path, { shared = true }))
+
+    eq(termios.fileno(a), termios.fileno(b), "fd")
+
+    assert(termios.cfsetspeed(a, 9600, "now"))
+
+    -- a reads the attributes, b changes the speed, then a applies its own change
+    local attr = assert(termios.tcgetattr(a))
+    assert(termios.cfsetspeed(b, 19200, "now"))
+    assert(attr:setflag("ECHO", true))
+    assert(attr:setvmin(5, 2))
+    assert(termios.tcsetattr(a, attr, "now"))
+
+    for _, got in ipairs{ assert(termios.tcgetattr(a)), assert(termios.tcgetattr(b)),
+            assert(termios.tcgetattr(slave)) } do
+        eq(got:cfgetospeed(), 19200, "ospeed")
+        eq(got:getflag("ECHO"), true, "ECHO")
+        local vmin, vtime = got:getvmin()
+        eq(vmin, 5, "vmin")
+        eq(vtime, 2, "vtime")
+    end
+
+    -- the same attribute changed from both, the last change wins
+    attr = assert(termios.tcgetattr(a))
+    assert(termios.cfsetspeed(b, 4800, "now"))
+    assert(attr:cfsetspeed(2400))
+    assert(termios.tcsetattr(a, attr, "now"))
+    eq(termios.cfgetospeed(b), 2400, "ospeed")
+    eq(termios.tcgetattr(slave):cfgetospeed(), 2400, "ospeed")
+
+    -- the fd stays open until the last port is closed
+    a:close()
+    eq(termios.cfgetospeed(b), 2400, "ospeed")
+    b:close()
+
+    closepty(master, slave)
+end)
+
+local failed = 0
+
+for _, t in ipairs(tests) do
+    local ok, err = pcall(t.fn)
+
+    if ok then
+        print("ok - " .. t.name)
+    else
+        print("not ok - " .. t.name .. ": " .. tostring(err))
+        failed = failed + 1
+    end
+    io.stdout:flush()
+end
+
+print(string.format("%d of %d tests failed", failed, #tests))
+
+if failed > 0 then
+    error("tests failed", 0)
+end